@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Absolute axes as virtual keys (--abs-threshold, --abs-zone): pressure
+ * pads, joysticks or touch zones are turned into EV_KEY events for a
+ * virtual key code, so they get the same short/long press handling as
+ * real keys.
+ *
+ * Axis values are collected and only evaluated on SYN_REPORT, and only
+ * for bindings one of whose axes changed in the frame. Axes without
+ * bindings are filtered out by a bitmask before anything else.
+ * Thresholds have hysteresis: pressed at <press>, released at
+ * <release>, with <press> < <release> for axes pressed downwards.
+ * Zones are inclusive rectangles on two axes, and are left when touch
+ * ends on devices reporting BTN_TOUCH.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "buttond.h"
+
+struct abs {
+	uint16_t code;
+	uint16_t axes[2];
+	bool zone;
+	/* threshold */
+	int press;
+	int release;
+	/* zone */
+	int x0, y0, x1, y1;
+	/* last values, zone needs both axes before being evaluated */
+	int values[2];
+	bool seen[2];
+	bool touch;
+	/* changed in current frame */
+	bool dirty;
+	bool pressed;
+};
+
+static const char *abs_names[] = {
+	[ABS_X] = "ABS_X",
+	[ABS_Y] = "ABS_Y",
+	[ABS_Z] = "ABS_Z",
+	[ABS_RX] = "ABS_RX",
+	[ABS_RY] = "ABS_RY",
+	[ABS_RZ] = "ABS_RZ",
+	[ABS_THROTTLE] = "ABS_THROTTLE",
+	[ABS_RUDDER] = "ABS_RUDDER",
+	[ABS_WHEEL] = "ABS_WHEEL",
+	[ABS_GAS] = "ABS_GAS",
+	[ABS_BRAKE] = "ABS_BRAKE",
+	[ABS_HAT0X] = "ABS_HAT0X",
+	[ABS_HAT0Y] = "ABS_HAT0Y",
+	[ABS_PRESSURE] = "ABS_PRESSURE",
+	[ABS_DISTANCE] = "ABS_DISTANCE",
+	[ABS_TILT_X] = "ABS_TILT_X",
+	[ABS_TILT_Y] = "ABS_TILT_Y",
+	[ABS_MISC] = "ABS_MISC",
+	[ABS_MT_POSITION_X] = "ABS_MT_POSITION_X",
+	[ABS_MT_POSITION_Y] = "ABS_MT_POSITION_Y",
+	[ABS_MT_PRESSURE] = "ABS_MT_PRESSURE",
+};
+
+static int abs_code(const char *name) {
+	for (size_t i = 0; i < sizeof(abs_names) / sizeof(abs_names[0]); i++) {
+		/* ABS_ prefix is optional */
+		if (abs_names[i] && (strcasecmp(abs_names[i], name) == 0
+				     || strcasecmp(abs_names[i] + 4, name) == 0))
+			return i;
+	}
+	int code = strtoint(name);
+	if (errno || code > ABS_MAX)
+		return -1;
+	return code;
+}
+
+static struct abs *abs_new(struct state *state, char *name) {
+	state->abss = xreallocarray(state->abss, state->abs_count + 1,
+				    sizeof(*state->abss));
+	struct abs *abs = &state->abss[state->abs_count++];
+	memset(abs, 0, sizeof(*abs));
+	abs->touch = true;
+	xassert(name[0], "Virtual key name cannot be empty");
+	abs->code = buttond_add_virtual_key(name);
+	xassert(abs->code, "Cannot add virtual key %s: name already used or more than %d",
+		name, BUTTOND_MAX_VIRTUAL_KEYS);
+	return abs;
+}
+
+static uint16_t abs_axis(struct state *state, const char *name) {
+	int code = abs_code(name);
+	xassert(code >= 0, "Unknown absolute axis %s", name);
+	state->abs_axes |= 1ULL << code;
+	return code;
+}
+
+/* split spec on colons, asserting there are exactly count fields */
+static void abs_split(char *spec, char **fields, int count,
+		      const char *option, const char *usage) {
+	char *orig = spec;
+
+	for (int i = 0; i < count; i++) {
+		fields[i] = spec;
+		spec = i < count - 1 ? strchr(spec, ':') : NULL;
+		xassert(spec || i == count - 1, "%s expects %s, got %s",
+			option, usage, orig);
+		if (spec)
+			*spec++ = 0;
+	}
+}
+
+/* <name>:<axis>:<press>:<release> */
+void abs_add_threshold(struct state *state, char *spec) {
+	char *fields[4];
+
+	abs_split(spec, fields, 4, "--abs-threshold",
+		  "<name>:<axis>:<press>:<release>");
+	struct abs *abs = abs_new(state, fields[0]);
+	abs->axes[0] = abs->axes[1] = abs_axis(state, fields[1]);
+	abs->press = strtos32(fields[2]);
+	xassert(errno == 0, "Invalid press value %s", fields[2]);
+	abs->release = strtos32(fields[3]);
+	xassert(errno == 0, "Invalid release value %s", fields[3]);
+	xassert(abs->press != abs->release,
+		"--abs-threshold %s: press and release values must differ",
+		fields[0]);
+	abs->seen[1] = true;
+}
+
+/* <name>:<x axis>:<y axis>:<x0>,<y0>,<x1>,<y1> */
+void abs_add_zone(struct state *state, char *spec) {
+	char *fields[4];
+
+	abs_split(spec, fields, 4, "--abs-zone",
+		  "<name>:<x axis>:<y axis>:<x0>,<y0>,<x1>,<y1>");
+	struct abs *abs = abs_new(state, fields[0]);
+	abs->zone = true;
+	abs->axes[0] = abs_axis(state, fields[1]);
+	abs->axes[1] = abs_axis(state, fields[2]);
+	xassert(sscanf(fields[3], "%d,%d,%d,%d",
+		       &abs->x0, &abs->y0, &abs->x1, &abs->y1) == 4
+		&& abs->x0 <= abs->x1 && abs->y0 <= abs->y1,
+		"--abs-zone %s: invalid rectangle %s", fields[0], fields[3]);
+}
+
+static bool abs_evaluate(struct abs *abs) {
+	if (!abs->seen[0] || !abs->seen[1])
+		return abs->pressed;
+	if (abs->zone)
+		return abs->touch
+			&& abs->values[0] >= abs->x0 && abs->values[0] <= abs->x1
+			&& abs->values[1] >= abs->y0 && abs->values[1] <= abs->y1;
+
+	int value = abs->values[0];
+	/* keep current state between release and press values */
+	if (abs->press > abs->release)
+		return abs->pressed ? value > abs->release : value >= abs->press;
+	return abs->pressed ? value < abs->release : value <= abs->press;
+}
+
+static void abs_frame(struct state *state, struct input_event *syn,
+		      const char *source) {
+	for (int i = 0; i < state->abs_count; i++) {
+		struct abs *abs = &state->abss[i];
+
+		if (!abs->dirty)
+			continue;
+		abs->dirty = false;
+		bool pressed = abs_evaluate(abs);
+		if (pressed == abs->pressed)
+			continue;
+		abs->pressed = pressed;
+
+		struct input_event event = {
+			.time = syn->time,
+			.type = EV_KEY,
+			.code = abs->code,
+			.value = pressed,
+		};
+		buttond_handle_event(&state->ctx, &event, source);
+	}
+}
+
+void abs_handle_event(struct state *state, struct input_event *event,
+		      const char *source) {
+	switch (event->type) {
+	case EV_ABS:
+		if (event->code > ABS_MAX
+		    || !(state->abs_axes & (1ULL << event->code)))
+			return;
+		for (int i = 0; i < state->abs_count; i++) {
+			struct abs *abs = &state->abss[i];
+
+			for (int j = 0; j < 2; j++) {
+				if (abs->axes[j] != event->code)
+					continue;
+				abs->values[j] = event->value;
+				abs->seen[j] = true;
+				abs->dirty = true;
+			}
+		}
+		return;
+	case EV_KEY:
+		if (event->code != BTN_TOUCH)
+			return;
+		for (int i = 0; i < state->abs_count; i++) {
+			struct abs *abs = &state->abss[i];
+
+			if (!abs->zone)
+				continue;
+			abs->touch = event->value;
+			abs->dirty = true;
+		}
+		return;
+	case EV_SYN:
+		if (event->code == SYN_REPORT) {
+			abs_frame(state, event, source);
+		} else if (event->code == SYN_DROPPED) {
+			/* incomplete frame: wait for the next one */
+			for (int i = 0; i < state->abs_count; i++)
+				state->abss[i].dirty = false;
+		}
+		return;
+	}
+}
+
+void abs_save(struct state *state, int fd) {
+	for (int i = 0; i < state->abs_count; i++) {
+		if (state->abss[i].pressed)
+			dprintf(fd, "abs %d\n", i);
+	}
+}
+
+void abs_restore(struct state *state, const char *line) {
+	int i;
+
+	if (sscanf(line, "abs %d", &i) != 1 || i < 0 || i >= state->abs_count)
+		return;
+	state->abss[i].pressed = true;
+}
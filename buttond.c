@@ -12,21 +12,53 @@
 #include "buttond.h"
 #include "version.h"
 
-/* debug:
+/* debug (state.ctx.debug):
  * -v (> 0/set): info message e.g. registered key presses
  * -vv (> 1): ignored keys also printed
  * -vvv (> 2): add non-keyboard events and file names
  * -vvvv (> 3): add timeout/wakeup related debugs
  */
-int debug = 0;
-int test_mode = 0;
 #define DEFAULT_LONG_PRESS_MSECS 5000
 #define DEFAULT_SHORT_PRESS_MSECS 1000
-#define DEFAULT_DEBOUNCE_MSECS 10
 
 #define OPT_TEST 257
 #define OPT_DEBOUNCE_TIME 258
 #define OPT_EXIT_AFTER 259
+#define OPT_STATE_FILE 260
+#define OPT_CONFIG_CACHE 261
+#define OPT_LAYER 262
+#define OPT_SWITCH_LAYER 263
+#define OPT_CONTROL 264
+#define OPT_IF 265
+#define OPT_UNLESS 266
+#define OPT_IDLE 267
+#define OPT_IDLE_RESUME 268
+#define OPT_IDLE_INPUT 269
+#define OPT_LED 270
+#define OPT_BLINK 271
+#define OPT_STAGE 272
+#define OPT_CANCEL 273
+#define OPT_KILL_ON_RELEASE 274
+#define OPT_MAX_RUNTIME 275
+#define OPT_REL 276
+#define OPT_REL_FILE 277
+#define OPT_ABS_THRESHOLD 278
+#define OPT_ABS_ZONE 279
+#define OPT_FF 280
+#define OPT_VIBRATE 281
+#define OPT_LAG_WARN 282
+#define OPT_METRICS_FILE 283
+#define OPT_METRICS_INTERVAL 284
+#define OPT_RECORDER 285
+#define OPT_RECORDER_SIZE 286
+#define OPT_LOG_FORMAT 287
+#define OPT_DRY_RUN 288
+#define OPT_DRY_RUN_LOG 289
+#define OPT_READER_THREADS 290
+#define OPT_COOLDOWN 291
+#define OPT_RATE_LIMIT 292
+#define OPT_CAPTURE_OUTPUT 293
+#define OPT_READY_FD 294
 
 static struct option long_options[] = {
 	{"inotify",	required_argument,	0, 'i' },
@@ -41,6 +73,41 @@ static struct option long_options[] = {
 	{"help",	no_argument,		0, 'h' },
 	{"test_mode",	no_argument,		0, OPT_TEST },
 	{"debounce-time", required_argument,	0, OPT_DEBOUNCE_TIME },
+	{"state-file",	required_argument,	0, OPT_STATE_FILE },
+	{"config-cache", required_argument,	0, OPT_CONFIG_CACHE },
+	{"layer",	required_argument,	0, OPT_LAYER },
+	{"switch-layer", required_argument,	0, OPT_SWITCH_LAYER },
+	{"control",	required_argument,	0, OPT_CONTROL },
+	{"if",		required_argument,	0, OPT_IF },
+	{"unless",	required_argument,	0, OPT_UNLESS },
+	{"idle",	required_argument,	0, OPT_IDLE },
+	{"idle-resume",	required_argument,	0, OPT_IDLE_RESUME },
+	{"idle-input",	required_argument,	0, OPT_IDLE_INPUT },
+	{"led",		required_argument,	0, OPT_LED },
+	{"blink",	required_argument,	0, OPT_BLINK },
+	{"ff",		required_argument,	0, OPT_FF },
+	{"vibrate",	required_argument,	0, OPT_VIBRATE },
+	{"lag-warn",	required_argument,	0, OPT_LAG_WARN },
+	{"metrics-file", required_argument,	0, OPT_METRICS_FILE },
+	{"metrics-interval", required_argument,	0, OPT_METRICS_INTERVAL },
+	{"recorder",	required_argument,	0, OPT_RECORDER },
+	{"recorder-size", required_argument,	0, OPT_RECORDER_SIZE },
+	{"log-format",	required_argument,	0, OPT_LOG_FORMAT },
+	{"dry-run",	no_argument,		0, OPT_DRY_RUN },
+	{"dry-run-log",	required_argument,	0, OPT_DRY_RUN_LOG },
+	{"reader-threads", required_argument,	0, OPT_READER_THREADS },
+	{"capture-output", required_argument,	0, OPT_CAPTURE_OUTPUT },
+	{"ready-fd",	required_argument,	0, OPT_READY_FD },
+	{"stage",	required_argument,	0, OPT_STAGE },
+	{"cancel",	required_argument,	0, OPT_CANCEL },
+	{"kill-on-release", no_argument,	0, OPT_KILL_ON_RELEASE },
+	{"max-runtime",	required_argument,	0, OPT_MAX_RUNTIME },
+	{"cooldown",	required_argument,	0, OPT_COOLDOWN },
+	{"rate-limit",	required_argument,	0, OPT_RATE_LIMIT },
+	{"rel",		required_argument,	0, OPT_REL },
+	{"rel-file",	required_argument,	0, OPT_REL_FILE },
+	{"abs-threshold", required_argument,	0, OPT_ABS_THRESHOLD },
+	{"abs-zone",	required_argument,	0, OPT_ABS_ZONE },
 	{0,		0,			0,  0  }
 };
 
@@ -58,11 +125,79 @@ static void help(char *argv0) {
 	printf("             action on short key press\n");
 	printf("  -l/--long <key> [-t/--time <time ms>] [--exit-after] -a/--action <command>:\n");
 	printf("             action on long key press\n");
+	printf("  --switch-layer <layer>: after -s/-l, switch to <layer> when action triggers\n");
+	printf("             (can be used instead of or in addition to -a)\n");
+	printf("  --kill-on-release: after -l, run action in background and stop it when key\n");
+	printf("             is released (if action triggered while key was held)\n");
+	printf("  --max-runtime <time ms>: after -s/-l, run action in background and stop it\n");
+	printf("             if still running after <time> (SIGTERM, then SIGKILL after 1s)\n");
+	printf("  --cooldown <time ms>: after -s/-l, ignore triggers within <time> of the\n");
+	printf("             last time the action ran\n");
+	printf("  --rate-limit <count>/<time ms>: after -s/-l, run action at most <count>\n");
+	printf("             times per <time>, ignoring triggers above that\n");
+	printf("  --stage <command>: after -l, run <command> as soon as <time> is reached while\n");
+	printf("             key is still held, even if the action itself only runs on release\n");
+	printf("  --cancel <command>: after -l, run <command> if key is released after reaching\n");
+	printf("             this stage but no action runs (-a is optional with --stage/--cancel)\n");
+	printf("  --if/--unless <condition>: after -s/-l, only run action if <condition> is\n");
+	printf("             (not) met when it triggers, up to %d per action. <condition> is one of\n",
+	       BUTTOND_MAX_GUARDS);
+	printf("             exists:<file>, content:<file>=<value>, layer:<layer>, held:<key>\n");
+	printf("  --layer <layer>: following -s/-l define bindings for <layer>, initially\n");
+	printf("             'default' which is also the active layer on startup\n");
+	printf("  --control <path>: listen for commands on unix socket <path>, send 'help' for list\n");
+	printf("  --idle <time ms>:<command>: run <command> after <time> without any input event\n");
+	printf("    [--idle-input <file>]...: only consider events from these inputs\n");
+	printf("    [--idle-resume <command>]: run <command> on first event after being idle\n");
+	printf("  --rel <axis>:<window ms>:<command>: run <command> with net movement of\n");
+	printf("             relative <axis> (e.g. REL_DIAL) in BUTTOND_DELTA, at most once\n");
+	printf("             per <window> starting from first movement\n");
+	printf("  --rel-file <axis>:<window ms>:<file>: same, but add movement to the value\n");
+	printf("             in <file> (e.g. sysfs brightness) instead of running a command\n");
+	printf("  --abs-threshold <name>:<axis>:<press>:<release>: virtual key <name> usable\n");
+	printf("             as <key>, pressed once absolute <axis> (e.g. ABS_PRESSURE) reaches\n");
+	printf("             <press> and released once back to <release>\n");
+	printf("  --abs-zone <name>:<x axis>:<y axis>:<x0>,<y0>,<x1>,<y1>: virtual key <name>\n");
+	printf("             pressed while position is within the rectangle (and touching)\n");
+	printf("  --led <target>: LED for following --blink, either a sysfs brightness file\n");
+	printf("             or <input device>:<LED name or code> to send EV_LED events\n");
+	printf("    --blink <trigger>:<key>:<on ms>,<off ms>,<count>: blink LED when <key> is\n");
+	printf("             pressed (trigger press), held past each of its long press times\n");
+	printf("             (threshold) or after running one of its actions (done)\n");
+	printf("  --ff <input device>: input to play following --vibrate on\n");
+	printf("    --vibrate <trigger>:<key>:<length ms>,<strong %%>,<weak %%>: play rumble\n");
+	printf("             effect on same triggers as --blink\n");
 	printf("  -E/--exit-timeout <time ms>: exit after <time> milliseconds\n");
 	printf("  --debounce-time <time ms>: duration to wait after keyup to merge any new keydown.\n");
 	printf("             In particular, some keyboards have a hardware repeat built-in so quick\n");
 	printf("             repetitions (default <%dms) are handled as if key was pressed continuosuly.\n",
-	       DEFAULT_DEBOUNCE_MSECS);
+	       BUTTOND_DEFAULT_DEBOUNCE_MSECS);
+	printf("  --lag-warn <time ms>: warn (at most every 10s) and count events read more\n");
+	printf("             than <time> after the kernel queued them (default 0, disabled)\n");
+	printf("  --metrics-file <file>: write Prometheus metrics to <file> (e.g. for\n");
+	printf("             node_exporter textfile collector) every --metrics-interval\n");
+	printf("             <time ms> (default 15000)\n");
+	printf("  --recorder <file>: keep last --recorder-size <count> (default 1024) events,\n");
+	printf("             key state changes and actions in memory, and write them to\n");
+	printf("             <file> on SIGUSR1, 'dump' control command, crash or failure\n");
+	printf("  --log-format text|kv|json: format of -v messages, kv (logfmt) and json add\n");
+	printf("             timestamp and level fields\n");
+	printf("  --dry-run: count actions (and rel file writes) instead of running them,\n");
+	printf("             and ignore --exit-after, to load test bindings. Counts and\n");
+	printf("             delays are shown on exit and by 'dry-run' control command\n");
+	printf("    [--dry-run-log <file>]: append a line per action and the exit summary\n");
+	printf("             to <file> instead of stdout\n");
+	printf("  --reader-threads <n>: read inputs from <n> threads instead of the event\n");
+	printf("             loop, for setups with hundreds of devices\n");
+	printf("  --capture-output <KiB>: keep last <KiB> of each action's stdout/stderr\n");
+	printf("             with its exit status and runtime for 'output' control command,\n");
+	printf("             dumped on stderr if it fails\n");
+	printf("  --ready-fd <fd>: write a newline to <fd> and close it once inputs are\n");
+	printf("             open (s6 notification-fd), NOTIFY_SOCKET is also supported\n");
+	printf("  --state-file <file>: keep held keys state in <file> (e.g. in /run) so\n");
+	printf("             long presses survive a buttond restart\n");
+	printf("  --config-cache <file>: store parsed key/action tables in <file> and reuse\n");
+	printf("             them directly on next start if arguments did not change\n");
 	printf("  -h, --help: show this help\n");
 	printf("  -V, --version: show version\n");
 	printf("  -v, --verbose: verbose (repeatable)\n\n");
@@ -71,6 +206,9 @@ static void help(char *argv0) {
 	printf("in uapi/linux/input-event-code.h or by running with -vv\n");
 	printf("(note for single digits e.g. '1' the key name is used)\n\n");
 
+	printf("Send SIGUSR2 to re-execute buttond (e.g. after upgrade) without losing\n");
+	printf("inputs or currently pressed keys.\n\n");
+
 	printf("Semantics: a short press action happens on release, if and only if\n");
 	printf("the button was released before <time> (default %d) milliseconds.\n",
 	       DEFAULT_SHORT_PRESS_MSECS);
@@ -79,24 +217,6 @@ static void help(char *argv0) {
 	       DEFAULT_LONG_PRESS_MSECS);
 }
 
-static int sort_actions_compare(const void *v1, const void *v2) {
-	const struct action *a1 = (const struct action*)v1;
-	const struct action *a2 = (const struct action*)v2;
-	if (a1->type == SHORT_PRESS)
-		return -1;
-	if (a2->type == SHORT_PRESS)
-		return 1;
-	if (a1->trigger_time < a2->trigger_time)
-		return -1;
-	if (a1->trigger_time > a2->trigger_time)
-		return 1;
-	return 0;
-}
-static void sort_actions(struct key *key) {
-	qsort(key->actions, key->action_count,
-		sizeof(key->actions[0]), sort_actions_compare);
-}
-
 static void add_input(char *path, struct state *state, bool inotify) {
 	/* skip directories */
 	struct stat sb;
@@ -133,113 +253,331 @@ static void add_input(char *path, struct state *state, bool inotify) {
 	}
 }
 
-struct action *add_action(char option, char *key, char *exit_timeout,
-		struct state *state) {
+static uint16_t parse_key(char *key) {
 	/* try to find key by name first, then by code if it failed */
-	uint16_t code = key ? find_key_by_name(key) : 0;
-	if (key && !code) {
+	uint16_t code = buttond_key_by_name(key);
+	if (!code) {
 		code = strtou16(key);
 	}
-	xassert(!key || code,
+	xassert(code,
 		"key code (%s) should be a key name or its keycode",
 		key);
+	return code;
+}
 
-	struct key *cur_key = NULL;
-	for (int i = 0; i < state->key_count; i++) {
-		if (state->keys[i].code == code) {
-			cur_key = &state->keys[i];
-			break;
-		}
-	}
-	if (!cur_key) {
-		state->keys = xreallocarray(state->keys,
-					    state->key_count + 1,
-					    sizeof(*state->keys));
-		cur_key = &state->keys[state->key_count];
-		state->key_count++;
-		memset(cur_key, 0, sizeof(*cur_key));
-		cur_key->code = code;
-		cur_key->state = KEY_RELEASED;
-	}
-	cur_key->actions = xreallocarray(cur_key->actions,
-			cur_key->action_count + 1,
-			sizeof(*cur_key->actions));
-
-	/* insert at the end, we'll sort later */
-	struct action *action = &cur_key->actions[cur_key->action_count];
-	cur_key->action_count++;
-	memset(action, 0, sizeof(*action));
-	action->trigger_time = DEFAULT_SHORT_PRESS_MSECS;
+static struct buttond_action *add_action(char option, char *key,
+		struct state *state) {
+	uint16_t code = parse_key(key);
+
+	struct buttond_action *action;
 	switch (option) {
 	case 's':
-		action->type = SHORT_PRESS;
+		action = buttond_add_action(&state->ctx, code, BUTTOND_SHORT_PRESS,
+					    DEFAULT_SHORT_PRESS_MSECS);
 		break;
 	case 'l':
-		action->type = LONG_PRESS;
-		break;
-	case 'E':
-		action->type = LONG_PRESS;
-		action->exit_after = true;
-		action->trigger_time = strtoint(exit_timeout);
-		xassert(action->trigger_time,
-			"Could not parse trigger time (%s): %m",
-			exit_timeout);
-		arm_key_press(cur_key, true);
+		action = buttond_add_action(&state->ctx, code, BUTTOND_LONG_PRESS,
+					    DEFAULT_SHORT_PRESS_MSECS);
 		break;
 	default:
 		xassert(false, "add_action should never be called with %c", option);
 	}
+	xassert(action, "Allocation failure");
 	return action;
 }
 
-int main(int argc, char *argv[]) {
-	struct state state = {
-		.debounce_msecs = DEFAULT_DEBOUNCE_MSECS,
-	};
-	struct action *cur_action = NULL;
-	bool inotify_enabled = false;
+static void add_guard(struct buttond_action *action, char *spec, bool negate,
+		      struct state *state) {
+	enum buttond_guard_type type;
+	int arg = 0;
+	const char *layer_name = NULL;
 
-	init_keynames();
+	if (strncmp(spec, "layer:", 6) == 0) {
+		type = BUTTOND_GUARD_LAYER;
+		layer_name = spec + 6;
+	} else if (strncmp(spec, "held:", 5) == 0) {
+		type = BUTTOND_GUARD_HELD;
+		arg = parse_key(spec + 5);
+	} else {
+		type = BUTTOND_GUARD_CONDITION;
+		arg = condition_add(state, spec);
+		xassert(arg >= 0, "Unknown condition %s", spec);
+	}
+	xassert(buttond_add_guard(action, type, negate, arg, layer_name) == 0,
+		"Too many conditions for action (max %d)", BUTTOND_MAX_GUARDS);
+}
 
-	int c;
-	while ((c = getopt_long(argc, argv, "i:s:l:a:t:E:vVh", long_options, NULL)) >= 0) {
-		switch (c) {
-		case 'i':
-			add_input(optarg, &state, true);
-			inotify_enabled = true;
-			break;
+struct binding_opt {
+	int opt;
+	char *arg;
+};
+
+static void add_bindings(struct state *state, struct binding_opt *bindings,
+			 int binding_count) {
+	struct buttond_action *cur_action = NULL;
+
+	for (int i = 0; i < binding_count; i++) {
+		char *arg = bindings[i].arg;
+
+		switch (bindings[i].opt) {
 		case 's':
 		case 'l':
 			xassert(!cur_action || cur_action->action != NULL,
 				"Must set action before specifying next key!");
-			cur_action = add_action(c, optarg, NULL, &state);
+			cur_action = add_action(bindings[i].opt, arg, state);
 			break;
 		case 'a':
 			xassert(cur_action,
 				"Action can only be provided after setting key code");
-			cur_action->action = optarg;
+			cur_action->action = arg;
 			break;
 		case 't':
 			xassert(cur_action,
 				"Action timeout can only be set after setting key code");
-			cur_action->trigger_time = strtoint(optarg);
+			cur_action->trigger_time = strtoint(arg);
 			xassert(cur_action->trigger_time,
 				"Could not parse trigger time (%s): %m",
-				optarg);
+				arg);
 			break;
 		case OPT_EXIT_AFTER:
 			xassert(cur_action,
 				"--exit-after can only be set after setting key code");
 			cur_action->exit_after = true;
 			break;
-		case 'E':
+		case OPT_KILL_ON_RELEASE:
+			xassert(cur_action && cur_action->type == BUTTOND_LONG_PRESS,
+				"--kill-on-release can only be set after -l");
+			cur_action->kill_on_release = true;
+			break;
+		case OPT_MAX_RUNTIME:
+			xassert(cur_action,
+				"--max-runtime can only be set after setting key code");
+			cur_action->max_runtime = strtoint(arg);
+			xassert(cur_action->max_runtime,
+				"Could not parse max runtime (%s): %m", arg);
+			break;
+		case OPT_COOLDOWN:
+			xassert(cur_action,
+				"--cooldown can only be set after setting key code");
+			cur_action->cooldown = strtoint(arg);
+			xassert(errno == 0 && cur_action->cooldown > 0,
+				"Could not parse cooldown (%s): %m", arg);
+			break;
+		case OPT_RATE_LIMIT:
+			xassert(cur_action,
+				"--rate-limit can only be set after setting key code");
+			xassert(sscanf(arg, "%d/%d", &cur_action->rate_count,
+				       &cur_action->rate_msecs) == 2
+				&& cur_action->rate_count > 0
+				&& cur_action->rate_msecs > 0,
+				"--rate-limit expects <count>/<time ms>, got %s", arg);
+			break;
+		case OPT_SWITCH_LAYER:
+			xassert(cur_action,
+				"--switch-layer can only be set after setting key code");
+			cur_action->switch_layer_name = arg;
+			/* no command required */
+			if (!cur_action->action)
+				cur_action->action = "";
+			break;
+		case OPT_STAGE:
+		case OPT_CANCEL:
+			xassert(cur_action && cur_action->type == BUTTOND_LONG_PRESS,
+				"--stage/--cancel can only be set after -l");
+			if (bindings[i].opt == OPT_STAGE)
+				cur_action->stage = arg;
+			else
+				cur_action->cancel = arg;
+			/* no command required */
+			if (!cur_action->action)
+				cur_action->action = "";
+			break;
+		case OPT_IF:
+		case OPT_UNLESS:
+			xassert(cur_action,
+				"--if/--unless can only be set after setting key code");
+			add_guard(cur_action, arg, bindings[i].opt == OPT_UNLESS,
+				  state);
+			break;
+		case OPT_LAYER:
 			xassert(!cur_action || cur_action->action != NULL,
-				"Cannot set stop timeout in the middle of defining a key");
-			/* add fake key with code 0 */
-			add_action('E', NULL, optarg, &state);
+				"Must set action before starting layer %s", arg);
+			xassert(buttond_add_layer(&state->ctx, arg) == 0,
+				"Allocation failure");
+			break;
+		}
+	}
+	xassert(!cur_action || cur_action->action != NULL,
+		"Last key press was defined without action");
+	xassert(buttond_finalize(&state->ctx) == 0,
+		"Invalid key configuration");
+}
+
+static void run_action(struct buttond_ctx *ctx, struct buttond_key *key,
+		       struct buttond_action *action, int64_t duration) {
+	/* special keys can have no action */
+	if (action->action && action->action[0]) {
+		const char *type = action->type == BUTTOND_LONG_PRESS ? "long" : "short";
+		struct timespec start;
+
+		if (ctx->debug)
+			log_printf("running %s after %"PRId64" ms\n",
+				   action->action, duration);
+		time_gettime(&start);
+		PROBE2(action_start, key->code, action->type);
+		recorder_action(key, action->type == BUTTOND_LONG_PRESS
+				? RECORD_ACTION_LONG : RECORD_ACTION_SHORT,
+				duration);
+		if (!dry_run_action(key, type, duration, &key->ts_wakeup,
+				    action->action)) {
+			spawn_set_env(key, type, duration);
+			/* exit_after waits for the action as before */
+			if ((action->kill_on_release || action->max_runtime)
+			    && !action->exit_after)
+				process_spawn(ctx->data, key, action);
+			else
+				spawn_wait(action->action);
+		}
+		metrics_action(key, type, &start);
+		PROBE3(action_done, key->code, action->type,
+		       start.tv_sec * NSECS_IN_SEC + start.tv_nsec);
+	}
+	led_action_done(ctx->data, key);
+	ff_action_done(ctx->data, key);
+	if (action->exit_after && !dry_run_enabled()) {
+		if (ctx->debug)
+			log_printf("Exiting after processing key %s (%d)\n",
+				   key->name, key->code);
+		exit(0);
+	}
+}
+
+static void run_stage(struct buttond_ctx *ctx, struct buttond_key *key,
+		      struct buttond_action *action, int64_t duration) {
+	led_key_stage(ctx->data, key);
+	ff_key_stage(ctx->data, key);
+	if (!action->stage)
+		return;
+	if (ctx->debug)
+		log_printf("running stage %s after %"PRId64" ms\n",
+			   action->stage, duration);
+	struct timespec start;
+	time_gettime(&start);
+	recorder_action(key, RECORD_ACTION_STAGE, duration);
+	if (!dry_run_action(key, "stage", duration, &key->ts_wakeup,
+			    action->stage)) {
+		spawn_set_env(key, "stage", duration);
+		spawn_wait(action->stage);
+	}
+	metrics_action(key, "stage", &start);
+}
+
+static void run_cancel(struct buttond_ctx *ctx, struct buttond_key *key,
+		       struct buttond_action *action, int64_t duration) {
+	if (!action->cancel)
+		return;
+	if (ctx->debug)
+		log_printf("running cancel %s after %"PRId64" ms\n",
+			   action->cancel, duration);
+	struct timespec start;
+	time_gettime(&start);
+	recorder_action(key, RECORD_ACTION_CANCEL, duration);
+	if (!dry_run_action(key, "cancel", duration, &key->ts_wakeup,
+			    action->cancel)) {
+		spawn_set_env(key, "cancel", duration);
+		spawn_wait(action->cancel);
+	}
+	metrics_action(key, "cancel", &start);
+}
+
+static void exit_timeout(struct state *state, struct timer *timer) {
+	(void)timer;
+	if (state->ctx.debug)
+		log_printf("Exiting after stop timeout\n");
+	exit(0);
+}
+
+static void key_transition(struct buttond_ctx *ctx, struct buttond_key *key,
+			   enum buttond_key_state old_state) {
+	struct state *state = ctx->data;
+
+	recorder_state(key, old_state);
+	snapshot_update(state, key);
+	led_key_transition(state, key, old_state);
+	ff_key_transition(state, key, old_state);
+	process_key_transition(state, key);
+}
+
+static void key_log(struct buttond_ctx *ctx, int level, const char *fmt,
+		    va_list ap) {
+	(void)ctx;
+	/* errors stay synchronous */
+	if (level == 0)
+		vfprintf(stderr, fmt, ap);
+	else
+		log_vprintf(level, fmt, ap);
+}
+
+static const struct buttond_ops buttond_ops = {
+	.action = run_action,
+	.stage = run_stage,
+	.cancel = run_cancel,
+	.transition = key_transition,
+	.log = key_log,
+};
+
+int main(int argc, char *argv[]) {
+	struct state state = { 0 };
+	struct binding_opt *bindings = NULL;
+	int binding_count = 0;
+	char *config_cache = NULL;
+	char *control_path = NULL;
+	int exit_msecs = 0;
+	struct timespec now;
+	sigset_t blocked, unblocked;
+	char *state_file = NULL;
+
+	buttond_init(&state.ctx, &buttond_ops, &state);
+	/* pending -v messages on exit() paths */
+	atexit(log_flush);
+
+	int c;
+	while ((c = getopt_long(argc, argv, "i:s:l:a:t:E:vVh", long_options, NULL)) >= 0) {
+		switch (c) {
+		case 'i':
+			add_input(optarg, &state, true);
+			state.inotify_enabled = true;
+			break;
+		case 's':
+		case 'l':
+		case 'a':
+		case 't':
+		case OPT_EXIT_AFTER:
+		case OPT_LAYER:
+		case OPT_SWITCH_LAYER:
+		case OPT_IF:
+		case OPT_UNLESS:
+		case OPT_STAGE:
+		case OPT_CANCEL:
+		case OPT_KILL_ON_RELEASE:
+		case OPT_MAX_RUNTIME:
+		case OPT_COOLDOWN:
+		case OPT_RATE_LIMIT:
+			/* handled after option parsing, unless cached */
+			bindings = xreallocarray(bindings, binding_count + 1,
+						 sizeof(*bindings));
+			bindings[binding_count].opt = c;
+			bindings[binding_count].arg = optarg;
+			binding_count++;
+			break;
+		case 'E':
+			exit_msecs = strtoint(optarg);
+			xassert(exit_msecs,
+				"Could not parse trigger time (%s): %m",
+				optarg);
 			break;
 		case 'v':
-			debug++;
+			state.ctx.debug++;
 			break;
 		case 'V':
 			version();
@@ -248,14 +586,90 @@ int main(int argc, char *argv[]) {
 			help(argv[0]);
 			exit(EXIT_SUCCESS);
 		case OPT_TEST:
-			test_mode = true;
+			state.test_mode = true;
 			break;
 		case OPT_DEBOUNCE_TIME:
-			state.debounce_msecs = strtoint(optarg);
+			state.ctx.debounce_msecs = strtoint(optarg);
 			xassert(errno == 0,
 				"Could not parse debounce time (%s): %m",
 				optarg);
 			break;
+		case OPT_LAG_WARN:
+			state.lag_warn_msecs = strtoint(optarg);
+			xassert(errno == 0 && state.lag_warn_msecs >= 0,
+				"Could not parse lag warning time (%s): %m",
+				optarg);
+			break;
+		case OPT_METRICS_FILE:
+			metrics_set_file(optarg);
+			break;
+		case OPT_METRICS_INTERVAL:
+			metrics_set_interval(optarg);
+			break;
+		case OPT_RECORDER:
+			recorder_set_file(optarg);
+			break;
+		case OPT_RECORDER_SIZE:
+			recorder_set_size(optarg);
+			break;
+		case OPT_LOG_FORMAT:
+			log_set_format(optarg);
+			break;
+		case OPT_DRY_RUN:
+			dry_run_enable();
+			break;
+		case OPT_DRY_RUN_LOG:
+			dry_run_set_log(optarg);
+			break;
+		case OPT_READER_THREADS:
+			readers_set_count(optarg);
+			break;
+		case OPT_CAPTURE_OUTPUT:
+			output_set_size(optarg);
+			break;
+		case OPT_READY_FD:
+			notify_set_fd(optarg);
+			break;
+		case OPT_STATE_FILE:
+			state_file = optarg;
+			break;
+		case OPT_CONFIG_CACHE:
+			config_cache = optarg;
+			break;
+		case OPT_CONTROL:
+			control_path = optarg;
+			break;
+		case OPT_IDLE:
+			idle_add(&state, optarg);
+			break;
+		case OPT_IDLE_RESUME:
+			idle_set_resume(&state, optarg);
+			break;
+		case OPT_IDLE_INPUT:
+			idle_add_input(&state, optarg);
+			break;
+		case OPT_REL:
+		case OPT_REL_FILE:
+			rel_add(&state, optarg, c == OPT_REL_FILE);
+			break;
+		case OPT_ABS_THRESHOLD:
+			abs_add_threshold(&state, optarg);
+			break;
+		case OPT_ABS_ZONE:
+			abs_add_zone(&state, optarg);
+			break;
+		case OPT_LED:
+			led_add(&state, optarg);
+			break;
+		case OPT_BLINK:
+			led_add_blink(&state, optarg);
+			break;
+		case OPT_FF:
+			ff_add(&state, optarg);
+			break;
+		case OPT_VIBRATE:
+			ff_add_vibration(&state, optarg);
+			break;
 		default:
 			help(argv[0]);
 			exit(EXIT_FAILURE);
@@ -266,53 +680,103 @@ int main(int argc, char *argv[]) {
 	}
 	xassert(state.input_count > 0,
 		"No input have been given, exiting");
-	xassert(state.key_count > 0 || debug > 1,
+	if (!config_cache || !cache_load(&state, config_cache, argc, argv)) {
+		add_bindings(&state, bindings, binding_count);
+		if (config_cache)
+			cache_save(&state, config_cache, argc, argv);
+	}
+	free(bindings);
+	xassert(state.ctx.layer_count > 0 || state.idle_count
+		|| state.rel_count || exit_msecs
+		|| state.ctx.debug > 1,
 		"No action given, exiting");
-	xassert(!cur_action || cur_action->action != NULL,
-		"Last key press was defined without action");
-	for (int i = 0; i < state.key_count; i++) {
-		struct key *key = &state.keys[i];
-		sort_actions(key);
-		for (int j = 1; j < key->action_count; j++) {
-			struct action *a1, *a2;
-			a1 = &key->actions[j-1];
-			a2 = &key->actions[j];
-			xassert(a1->type == a2->type || a1->trigger_time <= a2->trigger_time,
-				"Key %s had a short key (%d) longer than its shortest long key (%d)",
-				keyname_by_code(key->code),
-				a1->trigger_time, a2->trigger_time);
-			xassert(a1->type != a2->type || a1->trigger_time != a2->trigger_time,
-				"Key %s was defined twice with %d ms %s action",
-				keyname_by_code(key->code),
-				a1->trigger_time,
-				a1->type == SHORT_PRESS ? "short" : "long");
-		}
+
+	time_gettime(&now);
+	if (exit_msecs) {
+		timer_register(&state, &state.exit_timer, exit_timeout);
+		timer_arm(&state.exit_timer, &now, exit_msecs);
 	}
+	idle_start(&state, &now);
+	led_start(&state);
+	ff_start(&state);
+	rel_start(&state);
+	metrics_start(&state, &now);
+	process_init(&state);
 
-	state.pollfds = xcalloc(state.input_count + inotify_enabled, sizeof(*state.pollfds));
-	for (int i = 0; i < state.input_count; i++) {
+	sigemptyset(&blocked);
+	upgrade_init(argv, &blocked);
+	recorder_init(&blocked);
+	xassert(sigprocmask(SIG_BLOCK, &blocked, &unblocked) == 0,
+		"Could not block signals: %m");
+	/* after an upgrade they are already blocked in the inherited mask */
+	for (int sig = 1; sig < NSIG; sig++) {
+		if (sigismember(&blocked, sig) == 1)
+			sigdelset(&unblocked, sig);
+	}
+
+	int pollfd_count = state.input_count + POLLFD_SLOTS;
+	state.pollfds = xcalloc(pollfd_count, sizeof(*state.pollfds));
+	for (int i = 0; i < pollfd_count; i++) {
 		state.pollfds[i].fd = -1;
-		reopen_input(&state, i);
 	}
+	bool upgraded = upgrade_restore(&state);
+	notify_init();
+	spawn_init();
+	control_open(&state, control_path);
+	conditions_watch(&state);
+	if (state_file)
+		snapshot_open(&state, state_file);
+	for (int i = 0; i < state.input_count; i++) {
+		if (state.pollfds[i].fd < 0)
+			reopen_input(&state, i);
+	}
+	snapshot_forget(&state);
+	readers_start(&state);
+	/* inputs are then polled by reader threads, only poll fixed slots */
+	struct pollfd *pollfds = state.pollfds;
+	int poll_inputs = state.input_count;
+	if (readers_enabled()) {
+		pollfds = pollfd_slot(&state, 0);
+		pollfd_count = POLLFD_SLOTS;
+		poll_inputs = 0;
+	}
+	notify_ready(&state, upgraded);
 
-	if (debug > 1)
-		printf("Waiting for input, press a key to display it\n");
+	if (state.ctx.debug > 1)
+		log_printf("Waiting for input, press a key to display it\n");
 
 	while (1) {
-		int timeout = compute_timeout(state.keys, state.key_count);
-		int n = poll(state.pollfds, state.input_count + inotify_enabled, timeout);
-		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		time_gettime(&now);
+		int timeout = buttond_next_timeout(&state.ctx, &now);
+		int timers_timeout = timers_next_timeout(&state, &now);
+		if (timeout < 0 || (timers_timeout >= 0 && timers_timeout < timeout))
+			timeout = timers_timeout;
+		struct timespec ts_timeout = { 0 };
+		if (timeout > 0)
+			time_add_ts(&ts_timeout, timeout);
+		log_poll_prepare(&state);
+		/* signals are only unblocked here so we never sleep with
+		 * one pending */
+		int n = ppoll(pollfds, pollfd_count,
+			      timeout >= 0 ? &ts_timeout : NULL, &unblocked);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			upgrade_check(&state);
+			recorder_check(&state);
 			continue;
+		}
 		xassert(n >= 0, "Poll failure: %m");
+		state.wakeups++;
 
-		handle_timeouts(state.keys, state.key_count);
+		time_gettime(&now);
+		buttond_handle_timeouts(&state.ctx, &now);
+		timers_run(&state, &now);
 		if (n == 0)
 			continue;
-		for (int i = 0; i < state.input_count; i++) {
+		for (int i = 0; i < poll_inputs; i++) {
 			if (state.pollfds[i].revents == 0)
 				continue;
 			if (!(state.pollfds[i].revents & POLLIN)) {
-				if (test_mode)
+				if (state.test_mode)
 					exit(0);
 				fprintf(stderr, "got HUP/ERR on %s. Trying to reopen.\n",
 					state.input_files[i].filename);
@@ -322,11 +786,15 @@ int main(int argc, char *argv[]) {
 				reopen_input(&state, i);
 			}
 		}
-		if (inotify_enabled && state.pollfds[state.input_count].revents) {
-			xassert(state.pollfds[state.input_count].revents & POLLIN,
+		if (pollfd_slot(&state, POLLFD_INOTIFY)->revents) {
+			xassert(pollfd_slot(&state, POLLFD_INOTIFY)->revents & POLLIN,
 				"inotify fd went bad");
 			handle_inotify(&state);
 		}
+		control_handle(&state);
+		process_handle(&state);
+		readers_handle(&state);
+		log_handle(&state);
 	}
 
 	/* unreachable */
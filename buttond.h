@@ -3,56 +3,25 @@
 #ifndef BUTTOND_H
 #define BUTTOND_H
 
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <linux/input.h>
+#include <sys/syscall.h>
 
+#include "libbuttond.h"
+#include "probes.h"
 #include "utils.h"
 #include "time_utils.h"
 
-struct action {
-	/* type of action (long/short press) */
-	enum type {
-		LONG_PRESS,
-		SHORT_PRESS,
-	} type;
-	/* cutoff time for action */
-	int trigger_time;
-	/* command to run */
-	char const *action;
-	/* whether to stop after action has been processed */
-	bool exit_after;
-};
-
-struct key {
-	/* key code */
-	uint16_t code;
-	const char *name;
-
-	/* whether ts_wakeup below is valid */
-	bool has_wakeup;
-
-	/* key actions */
-	int action_count;
-	struct action *actions;
-
-	/* when key was pressed - valid for state == KEY_PRESSED or KEY_DEBOUNCE */
-	struct timeval tv_pressed;
-	/* valid when KEY_DEBOUNCE */
-	struct timeval tv_released;
-	/* when next to wakeup if has_wakeup is set */
-	struct timespec ts_wakeup;
-
-	/* state machine:
-	 * - RELEASED/PRESSED state
-	 * - DEBOUNCE: immediately after being released for DEBOUNCE_MSECS
-	 * - HANDLED: long press already handled (ignore until release)
-	 */
-	enum key_state {
-		KEY_RELEASED,
-		KEY_PRESSED,
-		KEY_DEBOUNCE,
-		KEY_HANDLED,
-	} state;
+/* delay between kernel event timestamps and our read, see input_lag */
+struct input_lag {
+	uint64_t events;
+	uint64_t total_usecs;
+	int64_t max_usecs;
+	/* events later than --lag-warn */
+	uint64_t late;
+	struct timespec last_warning;
 };
 
 struct input_file {
@@ -60,33 +29,291 @@ struct input_file {
 	char *filename;
 	char *dirent;
 	int inotify_wd;
+	struct input_lag lag;
+	uint64_t reopens;
+	/* --ff device: opened read-write */
+	bool ff;
+};
+
+struct state;
+
+struct timer {
+	struct timespec deadline;
+	bool armed;
+	void (*fire)(struct state *state, struct timer *timer);
+	/* registered timers list */
+	struct timer *next;
 };
 
+/* maximum number of tracked actions running at the same time */
+#define PROCESS_MAX 8
+
+/* pollfds has one entry per input followed by these fixed slots,
+ * unused slots have fd -1 */
+enum pollfd_slot {
+	POLLFD_INOTIFY,
+	POLLFD_CONTROL,
+	POLLFD_CONTROL_CLIENT,
+	/* stdout while log messages are pending */
+	POLLFD_LOG,
+	/* eventfd of --reader-threads */
+	POLLFD_READERS,
+	/* pidfds of tracked actions, PROCESS_MAX slots */
+	POLLFD_PROCESS,
+	/* their --capture-output pipes, PROCESS_MAX slots */
+	POLLFD_OUTPUT = POLLFD_PROCESS + PROCESS_MAX,
+	POLLFD_SLOTS = POLLFD_OUTPUT + PROCESS_MAX,
+};
+
+static inline int pidfd_open(pid_t pid) {
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+struct snapshot;
+struct condition;
+struct idle;
+struct led;
+struct blink;
+struct ff;
+struct vibration;
+struct rel;
+struct abs;
+struct inotify_event;
+
 struct state {
-	struct key *keys;
+	struct buttond_ctx ctx;
 	struct input_file *input_files;
 	struct pollfd *pollfds;
-	int key_count;
 	int input_count;
-	int debounce_msecs;
+	/* some input was given with -i */
+	bool inotify_enabled;
+	/* inputs are pipes from tests.sh: skip evdev ioctls and exit on HUP */
+	bool test_mode;
+	/* --lag-warn, 0 to disable */
+	int lag_warn_msecs;
+	/* poll returns, for metrics */
+	uint64_t wakeups;
+	/* --state-file, NULL if unset */
+	struct snapshot *snapshot;
+	struct timer *timers;
+	/* -E/--exit-timeout */
+	struct timer exit_timer;
+	/* file conditions for --if/--unless, values are read by ctx */
+	struct condition *conditions;
+	bool *condition_values;
+	int condition_count;
+	/* --idle actions */
+	struct idle *idles;
+	int idle_count;
+	/* --led and their --blink patterns */
+	struct led *leds;
+	int led_count;
+	struct blink *blinks;
+	int blink_count;
+	/* --ff devices and their --vibrate effects */
+	struct ff *ffs;
+	int ff_count;
+	struct vibration *vibrations;
+	int vibration_count;
+	/* --rel/--rel-file axes */
+	struct rel *rels;
+	int rel_count;
+	/* --abs-threshold/--abs-zone virtual keys, abs_axes has a bit per
+	 * axis used by any of them */
+	struct abs *abss;
+	int abs_count;
+	uint64_t abs_axes;
 };
 
-extern int debug;
-extern int test_mode;
-
+static inline struct pollfd *pollfd_slot(struct state *state,
+					 enum pollfd_slot slot) {
+	return &state->pollfds[state->input_count + slot];
+}
 
-/* keys.c */
-void init_keynames(void);
-uint16_t find_key_by_name (char *arg);
-const char *keyname_by_code(uint16_t code);
-void arm_key_press(struct key *key, bool reset_pressed);
-void handle_key(struct state *state, struct input_event *event, struct key *key);
-int compute_timeout(struct key *keys, int key_count);
-void handle_timeouts(struct key *keys, int key_count);
 
 /* input.c */
+int inotify_fd(struct state *state);
 void reopen_input(struct state *state, int i);
 void handle_inotify(struct state *state);
 int handle_input(struct state *state, int i);
+void input_events(struct state *state, int i, struct input_event *events,
+		  int count, const struct timespec *now);
+
+/* timers.c */
+void timer_register(struct state *state, struct timer *timer,
+		    void (*fire)(struct state *state, struct timer *timer));
+void timer_arm(struct timer *timer, const struct timespec *now, int msec);
+void timer_disarm(struct timer *timer);
+int timers_next_timeout(struct state *state, const struct timespec *now);
+void timers_run(struct state *state, const struct timespec *now);
+
+/* control.c */
+void control_open(struct state *state, const char *path);
+void control_handle(struct state *state);
+
+/* upgrade.c */
+void upgrade_init(char *argv[], sigset_t *blocked);
+void upgrade_check(struct state *state);
+bool upgrade_pending(void);
+bool upgrade_restore(struct state *state);
+
+/* cache.c */
+bool cache_load(struct state *state, const char *path,
+		int argc, char *argv[]);
+void cache_save(struct state *state, const char *path,
+		int argc, char *argv[]);
+
+/* conditions.c */
+int condition_add(struct state *state, const char *spec);
+const char *condition_spec(struct state *state, int i);
+void conditions_watch(struct state *state);
+void conditions_inotify_event(struct state *state,
+			      struct inotify_event *event);
+
+/* idle.c */
+void idle_add(struct state *state, char *spec);
+void idle_set_resume(struct state *state, const char *command);
+void idle_add_input(struct state *state, const char *filename);
+void idle_start(struct state *state, const struct timespec *now);
+void idle_activity(struct state *state, int input,
+		   const struct timespec *now);
+void idle_save(struct state *state, int fd);
+void idle_restore(struct state *state, const char *line);
+
+/* led.c */
+enum feedback_trigger {
+	FEEDBACK_PRESS,
+	FEEDBACK_THRESHOLD,
+	FEEDBACK_DONE,
+};
+enum feedback_trigger feedback_trigger(const char *option, const char *name);
+uint16_t feedback_key(const char *option, char *name);
+void led_add(struct state *state, const char *target);
+void led_add_blink(struct state *state, char *spec);
+void led_start(struct state *state);
+void led_key_transition(struct state *state, struct buttond_key *key,
+			enum buttond_key_state old_state);
+void led_key_stage(struct state *state, struct buttond_key *key);
+void led_action_done(struct state *state, struct buttond_key *key);
+
+/* ff.c */
+void ff_add(struct state *state, const char *path);
+void ff_add_vibration(struct state *state, char *spec);
+void ff_start(struct state *state);
+void ff_input_opened(struct state *state, int i);
+void ff_save(struct state *state, int fd);
+void ff_restore(struct state *state, const char *line);
+void ff_key_transition(struct state *state, struct buttond_key *key,
+		       enum buttond_key_state old_state);
+void ff_key_stage(struct state *state, struct buttond_key *key);
+void ff_action_done(struct state *state, struct buttond_key *key);
+
+/* metrics.c */
+void metrics_set_file(const char *path);
+void metrics_set_interval(const char *interval);
+void metrics_start(struct state *state, const struct timespec *now);
+void metrics_event_lag(int64_t usecs);
+void metrics_action(struct buttond_key *key, const char *type,
+		    const struct timespec *start);
+
+/* dryrun.c */
+void dry_run_enable(void);
+void dry_run_set_log(const char *path);
+bool dry_run_enabled(void);
+bool dry_run_action(struct buttond_key *key, const char *type, int64_t duration,
+		    const struct timespec *deadline, const char *command);
+void dry_run_report(FILE *out);
+
+/* log.c */
+void log_set_format(const char *name);
+__attribute__((format(printf, 1, 2)))
+void log_printf(const char *fmt, ...);
+void log_vprintf(int level, const char *fmt, va_list ap);
+void log_poll_prepare(struct state *state);
+void log_handle(struct state *state);
+void log_flush(void);
+uint64_t log_dropped(void);
+
+/* notify.c */
+void notify_set_fd(const char *fd);
+void notify_init(void);
+void notify_ready(struct state *state, bool upgraded);
+
+/* readers.c */
+struct reader_stats {
+	uint64_t reads;
+	uint64_t events;
+	uint64_t stalls;
+};
+void readers_set_count(const char *count);
+bool readers_enabled(void);
+void readers_start(struct state *state);
+void readers_add(struct state *state, int i);
+void readers_remove(struct state *state, int i);
+void readers_handle(struct state *state);
+bool readers_stats(int r, struct reader_stats *stats);
+
+/* recorder.c */
+enum record_action {
+	RECORD_ACTION_SHORT,
+	RECORD_ACTION_LONG,
+	RECORD_ACTION_STAGE,
+	RECORD_ACTION_CANCEL,
+};
+void recorder_set_file(const char *path);
+void recorder_set_size(const char *size);
+void recorder_init(sigset_t *blocked);
+void recorder_check(struct state *state);
+bool recorder_dump(struct state *state);
+void recorder_event(int input, const struct input_event *event);
+void recorder_state(struct buttond_key *key, enum buttond_key_state old_state);
+void recorder_action(struct buttond_key *key, enum record_action type,
+		     int64_t duration);
+
+/* process.c */
+void process_init(struct state *state);
+bool process_spawn(struct state *state, struct buttond_key *key,
+		   struct buttond_action *action);
+void process_key_transition(struct state *state, struct buttond_key *key);
+void process_handle(struct state *state);
+void process_save(struct state *state, int fd);
+void process_restore(struct state *state, const char *line);
+
+/* spawn.c */
+void spawn_init(void);
+void spawn_set_env(struct buttond_key *key, const char *type, int64_t duration);
+void spawn_set_delta(int delta);
+pid_t spawn(const char *command, int *output);
+void spawn_wait(const char *command);
+
+/* output.c */
+struct output;
+void output_set_size(const char *kib);
+struct output *output_get(const char *command);
+bool output_read(struct output *output, int fd);
+void output_wait(struct output *output, int fd, pid_t pid);
+void output_done(struct output *output, int status,
+		 const struct timespec *start);
+void output_report(FILE *out, int idx);
+
+/* rel.c */
+void rel_add(struct state *state, char *spec, bool file);
+void rel_start(struct state *state);
+void rel_handle_event(struct state *state, struct input_event *event,
+		      const char *source);
+
+/* abs.c */
+void abs_add_threshold(struct state *state, char *spec);
+void abs_add_zone(struct state *state, char *spec);
+void abs_handle_event(struct state *state, struct input_event *event,
+		      const char *source);
+void abs_save(struct state *state, int fd);
+void abs_restore(struct state *state, const char *line);
+
+/* snapshot.c */
+void snapshot_open(struct state *state, const char *path);
+void snapshot_update(struct state *state, struct buttond_key *key);
+bool snapshot_restore_key(struct state *state, struct buttond_key *key);
+void snapshot_forget(struct state *state);
 
 #endif
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Compiled configuration cache (--config-cache): the validated and
+ * sorted key/action tables are dumped as a binary image, which is
+ * mapped and used as is on next start if the command line did not
+ * change, skipping key name lookups, allocations and sorting.
+ *
+ * Layout: header, struct buttond_layer[], struct buttond_key[], struct buttond_action[],
+ * condition spec offsets (uint32_t[]), string pool.
+ * File conditions are registered again from their spec on load so
+ * guard indices stay valid.
+ * Pointers are stored as offsets and relocated in a private mapping,
+ * after checking a checksum of everything past the header.
+ * The image is only valid for the binary that wrote it (the hash
+ * covers version and structure sizes).
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "buttond.h"
+#include "version.h"
+
+#define CACHE_MAGIC 0x63647462 /* "btdc" */
+#define CACHE_VERSION 5
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t hash;
+	uint64_t checksum;
+	uint32_t layer_count;
+	uint32_t key_count;
+	uint32_t action_count;
+	uint32_t condition_count;
+	uint32_t strings_size;
+};
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t cache_hash(int argc, char *argv[]) {
+	uint64_t hash = FNV1A_INIT;
+	uint32_t sizes[] = {
+		sizeof(struct buttond_layer), sizeof(struct buttond_key),
+		sizeof(struct buttond_action),
+	};
+
+	hash = fnv1a(hash, BUTTOND_VERSION, sizeof(BUTTOND_VERSION));
+	hash = fnv1a(hash, sizes, sizeof(sizes));
+	/* argv[0] does not matter */
+	for (int i = 1; i < argc; i++)
+		hash = fnv1a(hash, argv[i], strlen(argv[i]) + 1);
+	return hash;
+}
+
+/* string offsets are stored +1 so 0 stays NULL */
+static bool relocate_string(const char **str, const char *strings,
+			    uint32_t strings_size) {
+	uintptr_t off = (uintptr_t)*str;
+
+	if (off == 0)
+		return true;
+	if (off > strings_size)
+		return false;
+	*str = strings + off - 1;
+	return true;
+}
+
+bool cache_load(struct state *state, const char *path,
+		int argc, char *argv[]) {
+	struct stat sb;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(struct cache_header)) {
+		close(fd);
+		return false;
+	}
+	void *base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	struct cache_header *header = base;
+	/* counts are checked against file size before making pointers */
+	uint64_t strings_off = sizeof(*header)
+		+ (uint64_t)header->layer_count * sizeof(struct buttond_layer)
+		+ (uint64_t)header->key_count * sizeof(struct buttond_key)
+		+ (uint64_t)header->action_count * sizeof(struct buttond_action)
+		+ (uint64_t)header->condition_count * sizeof(uint32_t);
+	if (header->magic != CACHE_MAGIC
+	    || header->version != CACHE_VERSION
+	    || header->hash != cache_hash(argc, argv)
+	    || strings_off + header->strings_size != (uint64_t)sb.st_size)
+		goto invalid;
+
+	struct buttond_layer *layers = (struct buttond_layer *)(header + 1);
+	struct buttond_key *keys = (struct buttond_key *)(layers + header->layer_count);
+	struct buttond_action *actions = (struct buttond_action *)(keys + header->key_count);
+	uint32_t *conditions = (uint32_t *)(actions + header->action_count);
+	char *strings = (char *)base + strings_off;
+
+	if ((header->strings_size && strings[header->strings_size - 1])
+	    || header->checksum != fnv1a(FNV1A_INIT, header + 1,
+					 sb.st_size - sizeof(*header)))
+		goto invalid;
+
+	for (uint32_t i = 0; i < header->layer_count; i++) {
+		struct buttond_layer *layer = &layers[i];
+		uintptr_t first = (uintptr_t)layer->keys;
+
+		if (first + layer->key_count > header->key_count
+		    || !relocate_string(&layer->name, strings,
+					header->strings_size)
+		    || !layer->name)
+			goto invalid;
+		layer->keys = &keys[first];
+	}
+	for (uint32_t i = 0; i < header->key_count; i++) {
+		struct buttond_key *key = &keys[i];
+		uintptr_t first = (uintptr_t)key->actions;
+
+		if (key->action_count <= 0
+		    || first + key->action_count > header->action_count)
+			goto invalid;
+		key->actions = &actions[first];
+		key->name = buttond_keyname(key->code);
+	}
+	for (uint32_t i = 0; i < header->action_count; i++) {
+		if (!relocate_string(&actions[i].action, strings,
+				     header->strings_size)
+		    || !relocate_string(&actions[i].switch_layer_name, strings,
+					header->strings_size)
+		    || !relocate_string(&actions[i].stage, strings,
+					header->strings_size)
+		    || !relocate_string(&actions[i].cancel, strings,
+					header->strings_size)
+		    || actions[i].switch_layer >= (int)header->layer_count)
+			goto invalid;
+		for (int g = 0; g < BUTTOND_MAX_GUARDS; g++) {
+			struct buttond_guard *guard = &actions[i].guards[g];
+			if (!relocate_string(&guard->layer_name, strings,
+					     header->strings_size)
+			    || (guard->type == BUTTOND_GUARD_CONDITION
+				&& (guard->arg < 0
+				    || guard->arg >= (int)header->condition_count)))
+				goto invalid;
+		}
+	}
+	for (uint32_t i = 0; i < header->condition_count; i++) {
+		if (conditions[i] == 0 || conditions[i] > header->strings_size)
+			goto invalid;
+	}
+	/* nothing can fail past this point */
+	for (uint32_t i = 0; i < header->condition_count; i++)
+		condition_add(state, strings + conditions[i] - 1);
+
+	state->ctx.layers = layers;
+	state->ctx.layer_count = header->layer_count;
+	if (header->layer_count) {
+		state->ctx.keys = layers[0].keys;
+		state->ctx.key_count = layers[0].key_count;
+	}
+	if (state->ctx.debug)
+		log_printf("using cached configuration from %s\n", path);
+	return true;
+
+invalid:
+	if (state->ctx.debug)
+		log_printf("ignoring outdated configuration cache %s\n", path);
+	munmap(base, sb.st_size);
+	return false;
+}
+
+static uintptr_t add_string(char **strings, uint32_t *size, const char *str) {
+	if (!str)
+		return 0;
+
+	size_t len = strlen(str) + 1;
+	uintptr_t off = *size + 1;
+	*strings = xreallocarray(*strings, *size + len, 1);
+	memcpy(*strings + *size, str, len);
+	*size += len;
+	return off;
+}
+
+void cache_save(struct state *state, const char *path,
+		int argc, char *argv[]) {
+	struct buttond_ctx *ctx = &state->ctx;
+	struct cache_header header = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.hash = cache_hash(argc, argv),
+		.layer_count = ctx->layer_count,
+	};
+	struct buttond_layer *layers = xcalloc(ctx->layer_count, sizeof(*layers));
+	struct buttond_key *keys = NULL;
+	struct buttond_action *actions = NULL;
+	uint32_t *conditions = xcalloc(state->condition_count,
+				       sizeof(*conditions));
+	char *strings = NULL;
+
+	for (int l = 0; l < ctx->layer_count; l++) {
+		struct buttond_layer *layer = &layers[l];
+		struct buttond_layer *src = &ctx->layers[l];
+
+		layer->name = (const char *)add_string(&strings,
+				&header.strings_size, src->name);
+		layer->key_count = src->key_count;
+		layer->keys = (struct buttond_key *)(uintptr_t)header.key_count;
+
+		keys = xreallocarray(keys, header.key_count + src->key_count,
+				     sizeof(*keys));
+		for (int i = 0; i < src->key_count; i++) {
+			struct buttond_key *key = &keys[header.key_count++];
+
+			/* only keep static configuration, runtime state is zeroed */
+			memset(key, 0, sizeof(*key));
+			key->code = src->keys[i].code;
+			key->action_count = src->keys[i].action_count;
+			key->state = BUTTOND_KEY_RELEASED;
+			key->actions = (struct buttond_action *)(uintptr_t)header.action_count;
+
+			actions = xreallocarray(actions,
+					header.action_count + key->action_count,
+					sizeof(*actions));
+			for (int j = 0; j < key->action_count; j++) {
+				struct buttond_action *action = &actions[header.action_count++];
+
+				*action = src->keys[i].actions[j];
+				action->action = (const char *)add_string(&strings,
+						&header.strings_size, action->action);
+				action->switch_layer_name = (const char *)add_string(&strings,
+						&header.strings_size, action->switch_layer_name);
+				action->stage = (const char *)add_string(&strings,
+						&header.strings_size, action->stage);
+				action->cancel = (const char *)add_string(&strings,
+						&header.strings_size, action->cancel);
+				for (int g = 0; g < BUTTOND_MAX_GUARDS; g++) {
+					struct buttond_guard *guard = &action->guards[g];
+					guard->layer_name = (const char *)add_string(&strings,
+							&header.strings_size, guard->layer_name);
+				}
+			}
+		}
+	}
+	header.condition_count = state->condition_count;
+	for (int i = 0; i < state->condition_count; i++)
+		conditions[i] = add_string(&strings, &header.strings_size,
+					   condition_spec(state, i));
+
+	header.checksum = fnv1a(FNV1A_INIT, layers,
+				header.layer_count * sizeof(*layers));
+	header.checksum = fnv1a(header.checksum, keys,
+				header.key_count * sizeof(*keys));
+	header.checksum = fnv1a(header.checksum, actions,
+				header.action_count * sizeof(*actions));
+	header.checksum = fnv1a(header.checksum, conditions,
+				header.condition_count * sizeof(*conditions));
+	header.checksum = fnv1a(header.checksum, strings, header.strings_size);
+
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		goto out;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Could not write configuration cache %s: %m\n", tmp);
+		goto out;
+	}
+	bool ok = write(fd, &header, sizeof(header)) == sizeof(header)
+		&& write(fd, layers, header.layer_count * sizeof(*layers))
+			== (ssize_t)(header.layer_count * sizeof(*layers))
+		&& write(fd, keys, header.key_count * sizeof(*keys))
+			== (ssize_t)(header.key_count * sizeof(*keys))
+		&& write(fd, actions, header.action_count * sizeof(*actions))
+			== (ssize_t)(header.action_count * sizeof(*actions))
+		&& write(fd, conditions, header.condition_count * sizeof(*conditions))
+			== (ssize_t)(header.condition_count * sizeof(*conditions))
+		&& write(fd, strings, header.strings_size)
+			== (ssize_t)header.strings_size;
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp, path) != 0) {
+		fprintf(stderr, "Could not write configuration cache %s: %m\n", path);
+		unlink(tmp);
+	}
+
+out:
+	free(layers);
+	free(keys);
+	free(actions);
+	free(conditions);
+	free(strings);
+}
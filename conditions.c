@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: MIT
+/*
+ * File conditions for action guards (--if/--unless exists:<file> or
+ * content:<file>=<value>): each file's parent directory is watched
+ * with inotify and the result cached in state->condition_values, which
+ * the library reads directly when a guarded action triggers.
+ * If that directory does not exist (yet) the condition is false and its
+ * closest existing ancestor is watched instead, going down as missing
+ * directories are created.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+#include "buttond.h"
+
+#define CONDITION_WATCH_FLAGS (IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+			       | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF \
+			       | IN_MASK_ADD)
+
+/* content conditions only compare that much of the file */
+#define CONDITION_CONTENT_MAX 256
+
+struct condition {
+	/* original spec, also used for the configuration cache */
+	char *spec;
+	enum {
+		CONDITION_EXISTS,
+		CONDITION_CONTENT,
+	} type;
+	char *path;
+	char *value;
+	/* basename of path, as reported by inotify */
+	const char *base;
+	int wd;
+	/* path component expected in the watched directory: base, or the
+	 * next missing directory if watching an ancestor */
+	const char *next;
+	int next_len;
+};
+
+static bool condition_eval(struct condition *condition) {
+	if (condition->type == CONDITION_EXISTS)
+		return access(condition->path, F_OK) == 0;
+
+	char buf[CONDITION_CONTENT_MAX + 1];
+	int fd = open(condition->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	int n = read_safe(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n < 0)
+		return false;
+	/* ignore trailing newline as written by echo */
+	if (n > 0 && buf[n - 1] == '\n')
+		n--;
+	buf[n] = 0;
+	return strcmp(buf, condition->value) == 0;
+}
+
+static void condition_update(struct state *state, int i) {
+	struct condition *condition = &state->conditions[i];
+	bool value = condition_eval(condition);
+
+	if (state->ctx.debug > 1 && value != state->condition_values[i])
+		log_printf("condition %s is now %s\n", condition->spec,
+			   value ? "true" : "false");
+	state->condition_values[i] = value;
+}
+
+/* returns condition index for spec, or -1 if not a file condition */
+int condition_add(struct state *state, const char *spec) {
+	int type;
+	const char *path;
+
+	if (strncmp(spec, "exists:", 7) == 0) {
+		type = CONDITION_EXISTS;
+		path = spec + 7;
+	} else if (strncmp(spec, "content:", 8) == 0) {
+		type = CONDITION_CONTENT;
+		path = spec + 8;
+	} else {
+		return -1;
+	}
+
+	for (int i = 0; i < state->condition_count; i++) {
+		if (strcmp(state->conditions[i].spec, spec) == 0)
+			return i;
+	}
+
+	state->conditions = xreallocarray(state->conditions,
+			state->condition_count + 1,
+			sizeof(*state->conditions));
+	struct condition *condition = &state->conditions[state->condition_count];
+	memset(condition, 0, sizeof(*condition));
+	condition->type = type;
+	condition->wd = -1;
+	condition->spec = xstrdup(spec);
+	condition->path = xstrdup(path);
+	if (type == CONDITION_CONTENT) {
+		char *eq = strchr(condition->path, '=');
+		xassert(eq, "condition %s: expected content:<file>=<value>", spec);
+		*eq = 0;
+		condition->value = eq + 1;
+	}
+	xassert(condition->path[0], "condition %s: empty file name", spec);
+	char *slash = strrchr(condition->path, '/');
+	condition->base = slash ? slash + 1 : condition->path;
+	xassert(condition->base[0], "condition %s: not a file", spec);
+
+	/* inotify fd is shared with inputs, make sure upgrade keeps it */
+	state->inotify_enabled = true;
+	return state->condition_count++;
+}
+
+const char *condition_spec(struct state *state, int i) {
+	return state->conditions[i].spec;
+}
+
+/* watch the file's directory, or its closest existing ancestor */
+static void condition_watch(struct state *state, int i) {
+	struct condition *condition = &state->conditions[i];
+	const char *path = condition->path;
+	/* length of path prefix to watch, 0 for / or . */
+	int len = condition->base - path - 1;
+	char dir[PATH_MAX];
+
+	xassert(condition->base - path < PATH_MAX, "path too long: %s", path);
+	while (1) {
+		if (len > 0) {
+			memcpy(dir, path, len);
+			dir[len] = 0;
+		} else {
+			strcpy(dir, path[0] == '/' ? "/" : ".");
+		}
+		/* same directory as an input or other condition returns the
+		 * same wd, IN_MASK_ADD keeps the other flags */
+		condition->wd = inotify_add_watch(inotify_fd(state), dir,
+						  CONDITION_WATCH_FLAGS);
+		if (condition->wd >= 0)
+			break;
+		if ((errno != ENOENT && errno != ENOTDIR) || len <= 0) {
+			fprintf(stderr, "Could not watch %s for condition %s: %m\n",
+				dir, condition->spec);
+			return;
+		}
+		/* try parent */
+		do
+			len--;
+		while (len > 0 && path[len] != '/');
+	}
+
+	condition->next = len > 0 ? path + len + 1
+		: path + (path[0] == '/');
+	condition->next_len = strcspn(condition->next, "/");
+	if (state->ctx.debug > 1 && condition->next != condition->base)
+		log_printf("condition %s: watching %s until %.*s exists\n",
+			   condition->spec, dir, condition->next_len,
+			   condition->next);
+}
+
+void conditions_watch(struct state *state) {
+	if (!state->condition_count)
+		return;
+
+	state->condition_values = xcalloc(state->condition_count,
+					  sizeof(*state->condition_values));
+	for (int i = 0; i < state->condition_count; i++) {
+		condition_watch(state, i);
+		condition_update(state, i);
+	}
+	state->ctx.conditions = state->condition_values;
+	state->ctx.condition_count = state->condition_count;
+}
+
+void conditions_inotify_event(struct state *state,
+			      struct inotify_event *event) {
+	for (int i = 0; i < state->condition_count; i++) {
+		struct condition *condition = &state->conditions[i];
+		if (event->wd != condition->wd)
+			continue;
+		/* watched directory gone: back to an ancestor */
+		if (event->mask & IN_DELETE_SELF) {
+			condition_watch(state, i);
+			condition_update(state, i);
+			continue;
+		}
+		if (!event->len
+		    || strncmp(event->name, condition->next, condition->next_len)
+		    || event->name[condition->next_len])
+			continue;
+		/* missing directory created: go down */
+		if (condition->next != condition->base)
+			condition_watch(state, i);
+		condition_update(state, i);
+	}
+}
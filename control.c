@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Control socket (--control <path>): unix stream socket accepting one
+ * command line per connection, e.g.
+ *   echo 'layer maintenance' | socat - UNIX-CONNECT:/run/buttond.sock
+ * Only one client is served at a time, others wait in the backlog.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "buttond.h"
+
+/* clients that do not send a full line in time are dropped */
+#define CONTROL_CLIENT_TIMEOUT_MSECS 1000
+
+static char client_buf[256];
+static size_t client_len;
+static struct timer client_timer;
+
+static void cmd_help(struct state *state, char *args, FILE *out);
+
+static void cmd_layer(struct state *state, char *args, FILE *out) {
+	struct buttond_ctx *ctx = &state->ctx;
+
+	if (!args[0]) {
+		if (ctx->layer_count)
+			fprintf(out, "%s\n", ctx->layers[ctx->layer].name);
+		return;
+	}
+	int layer = buttond_find_layer(ctx, args);
+	if (layer < 0) {
+		fprintf(out, "error: unknown layer %s\n", args);
+		return;
+	}
+	buttond_set_layer(ctx, layer);
+	fprintf(out, "ok\n");
+}
+
+static void cmd_lag(struct state *state, char *args, FILE *out) {
+	(void)args;
+	for (int i = 0; i < state->input_count; i++) {
+		struct input_lag *lag = &state->input_files[i].lag;
+
+		fprintf(out, "%s events %"PRIu64" avg_us %"PRIu64" max_us %"PRId64" late %"PRIu64"\n",
+			state->input_files[i].filename, lag->events,
+			lag->events ? lag->total_usecs / lag->events : 0,
+			lag->max_usecs, lag->late);
+	}
+}
+
+static void cmd_dump(struct state *state, char *args, FILE *out) {
+	(void)args;
+	fprintf(out, recorder_dump(state) ? "ok\n"
+		: "error: recorder not enabled or not writable\n");
+}
+
+static void cmd_dry_run(struct state *state, char *args, FILE *out) {
+	(void)state;
+	(void)args;
+	if (!dry_run_enabled()) {
+		fprintf(out, "error: not in dry run mode\n");
+		return;
+	}
+	dry_run_report(out);
+}
+
+static void cmd_readers(struct state *state, char *args, FILE *out) {
+	struct reader_stats stats;
+
+	(void)state;
+	(void)args;
+	for (int r = 0; readers_stats(r, &stats); r++)
+		fprintf(out, "reader %d reads %"PRIu64" events %"PRIu64" stalls %"PRIu64"\n",
+			r, stats.reads, stats.events, stats.stalls);
+}
+
+static void cmd_output(struct state *state, char *args, FILE *out) {
+	int idx = -1;
+
+	(void)state;
+	if (args[0]) {
+		idx = strtoint(args);
+		if (errno || idx < 0) {
+			fprintf(out, "error: invalid index %s\n", args);
+			return;
+		}
+	}
+	output_report(out, idx);
+}
+
+static const struct control_command {
+	const char *name;
+	const char *usage;
+	void (*handle)(struct state *state, char *args, FILE *out);
+} commands[] = {
+	{ "help", "", cmd_help },
+	{ "layer", "[<name>]: show or switch active layer", cmd_layer },
+	{ "dump", ": write flight recorder file (--recorder)", cmd_dump },
+	{ "lag", ": show per input delay between events and their read", cmd_lag },
+	{ "dry-run", ": show actions counted by --dry-run", cmd_dry_run },
+	{ "readers", ": show --reader-threads counters", cmd_readers },
+	{ "output", "[<n>]: list --capture-output commands or show output of one", cmd_output },
+};
+
+static void cmd_help(struct state *state, char *args, FILE *out) {
+	(void)state;
+	(void)args;
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		/* usage is args then description, args can be empty */
+		if (commands[i].usage[0])
+			fprintf(out, "%s%s%s\n", commands[i].name,
+				commands[i].usage[0] == ':' ? "" : " ",
+				commands[i].usage);
+	}
+}
+
+static void client_close(struct state *state) {
+	struct pollfd *client = pollfd_slot(state, POLLFD_CONTROL_CLIENT);
+
+	close(client->fd);
+	client->fd = -1;
+	client->events = 0;
+	client_len = 0;
+	timer_disarm(&client_timer);
+	/* accept next client */
+	pollfd_slot(state, POLLFD_CONTROL)->events = POLLIN;
+}
+
+static void client_timeout(struct state *state, struct timer *timer) {
+	(void)timer;
+	if (state->ctx.debug)
+		log_printf("control client timed out\n");
+	client_close(state);
+}
+
+static void run_command(struct state *state, char *line, int fd) {
+	char *reply = NULL;
+	size_t reply_len = 0;
+	FILE *out = open_memstream(&reply, &reply_len);
+	if (!out)
+		return;
+
+	char *args = line + strcspn(line, " ");
+	if (*args) {
+		*args = 0;
+		args++;
+	}
+	size_t i;
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (strcmp(commands[i].name, line) == 0) {
+			commands[i].handle(state, args, out);
+			break;
+		}
+	}
+	if (i == sizeof(commands) / sizeof(commands[0]))
+		fprintf(out, "error: unknown command %s, try help\n", line);
+	fclose(out);
+
+	/* best effort: the socket buffer is large enough for our replies,
+	 * never wait for a client that does not read */
+	size_t done = 0;
+	while (done < reply_len) {
+		ssize_t n = send(fd, reply + done, reply_len - done,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	free(reply);
+}
+
+static void handle_client(struct state *state) {
+	struct pollfd *client = pollfd_slot(state, POLLFD_CONTROL_CLIENT);
+
+	ssize_t n = read(client->fd, client_buf + client_len,
+			 sizeof(client_buf) - 1 - client_len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n > 0)
+		client_len += n;
+	client_buf[client_len] = 0;
+
+	char *eol = strchr(client_buf, '\n');
+	if (!eol && n > 0 && client_len < sizeof(client_buf) - 1)
+		return;
+	/* full line, EOF or line too long: run what we have */
+	if (eol)
+		*eol = 0;
+	if (client_len) {
+		if (state->ctx.debug)
+			log_printf("control command: %s\n", client_buf);
+		run_command(state, client_buf, client->fd);
+	}
+	client_close(state);
+}
+
+static void accept_client(struct state *state) {
+	struct pollfd *listen_fd = pollfd_slot(state, POLLFD_CONTROL);
+	struct pollfd *client = pollfd_slot(state, POLLFD_CONTROL_CLIENT);
+
+	int fd = accept4(listen_fd->fd, NULL, NULL,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	client->fd = fd;
+	client->events = POLLIN;
+	client_len = 0;
+	/* one client at a time */
+	listen_fd->events = 0;
+
+	struct timespec now;
+	time_gettime(&now);
+	timer_arm(&client_timer, &now, CONTROL_CLIENT_TIMEOUT_MSECS);
+}
+
+void control_open(struct state *state, const char *path) {
+	struct pollfd *listen_fd = pollfd_slot(state, POLLFD_CONTROL);
+
+	/* inherited on upgrade */
+	if (listen_fd->fd >= 0) {
+		if (path)
+			goto out;
+		close(listen_fd->fd);
+		listen_fd->fd = -1;
+		listen_fd->events = 0;
+	}
+	if (!path)
+		return;
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	xassert(strlen(path) < sizeof(addr.sun_path),
+		"control socket path too long: %s", path);
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	xassert(fd >= 0, "Could not create control socket: %m");
+	/* stale socket from previous run */
+	unlink(path);
+	xassert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+		"Could not bind control socket %s: %m", path);
+	xassert(listen(fd, 4) == 0,
+		"Could not listen on control socket %s: %m", path);
+	listen_fd->fd = fd;
+	listen_fd->events = POLLIN;
+out:
+	timer_register(state, &client_timer, client_timeout);
+}
+
+void control_handle(struct state *state) {
+	if (pollfd_slot(state, POLLFD_CONTROL)->fd < 0)
+		return;
+	if (pollfd_slot(state, POLLFD_CONTROL_CLIENT)->revents)
+		handle_client(state);
+	if (pollfd_slot(state, POLLFD_CONTROL)->revents & POLLIN)
+		accept_client(state);
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Dry run (--dry-run): bindings go through the full state machine and
+ * scheduling, but actions are only counted instead of run, so a
+ * production configuration can be soak-tested against recorded or
+ * synthetic events. This covers key, stage, cancel, idle and rel
+ * commands and rel files; --exit-after is ignored.
+ *
+ * Counts per key and action type, with how late actions fired
+ * compared to the wakeup scheduled for them, are shown by the `dry-run`
+ * control command and on exit, on stdout or at the end of
+ * --dry-run-log <file> which also gets one line per would-be action.
+ */
+
+#include <string.h>
+
+#include "buttond.h"
+
+struct dry_run_counter {
+	const char *name;
+	const char *type;
+	uint64_t count;
+	int64_t late_max_usecs;
+	int64_t late_total_usecs;
+};
+
+static bool enabled;
+static FILE *dry_run_log;
+static struct dry_run_counter *counters;
+static int counter_count;
+
+/* summary goes at the end of the log if there is one */
+static void dry_run_exit(void) {
+	if (dry_run_log) {
+		dry_run_report(dry_run_log);
+		fclose(dry_run_log);
+		return;
+	}
+	/* queued -v messages first */
+	log_flush();
+	dry_run_report(stdout);
+	fflush(stdout);
+}
+
+void dry_run_enable(void) {
+	if (enabled)
+		return;
+	enabled = true;
+	atexit(dry_run_exit);
+}
+
+void dry_run_set_log(const char *path) {
+	dry_run_enable();
+	dry_run_log = fopen(path, "ae");
+	xassert(dry_run_log, "Could not open %s: %m", path);
+}
+
+bool dry_run_enabled(void) {
+	return enabled;
+}
+
+static struct dry_run_counter *counter_get(const char *name, const char *type) {
+	for (int i = 0; i < counter_count; i++) {
+		if (strcmp(counters[i].name, name) == 0
+		    && strcmp(counters[i].type, type) == 0)
+			return &counters[i];
+	}
+	counters = xreallocarray(counters, counter_count + 1, sizeof(*counters));
+	struct dry_run_counter *counter = &counters[counter_count++];
+	memset(counter, 0, sizeof(*counter));
+	counter->name = name;
+	counter->type = type;
+	return counter;
+}
+
+/* returns true if command must not run. key can be NULL (idle),
+ * deadline is when the action was scheduled to run if known */
+bool dry_run_action(struct buttond_key *key, const char *type, int64_t duration,
+		    const struct timespec *deadline, const char *command) {
+	struct timespec now;
+	int64_t late_usecs = 0;
+
+	if (!enabled)
+		return false;
+
+	time_gettime(&now);
+	if (deadline)
+		late_usecs = (now.tv_sec - deadline->tv_sec) * USECS_IN_SEC
+			+ (now.tv_nsec - deadline->tv_nsec) / NSECS_IN_USEC;
+	const char *name = key ? key->name : "";
+	struct dry_run_counter *counter = counter_get(name, type);
+	counter->count++;
+	counter->late_total_usecs += late_usecs;
+	if (late_usecs > counter->late_max_usecs)
+		counter->late_max_usecs = late_usecs;
+
+	if (dry_run_log)
+		fprintf(dry_run_log, "%ld.%03ld key=%s type=%s duration_ms=%"PRId64" late_us=%"PRId64" command=%s\n",
+			(long)now.tv_sec, now.tv_nsec / NSECS_IN_MSEC, name, type,
+			duration, late_usecs, command);
+	return true;
+}
+
+void dry_run_report(FILE *out) {
+	for (int i = 0; i < counter_count; i++) {
+		struct dry_run_counter *counter = &counters[i];
+
+		fprintf(out, "dry-run %s %s count %"PRIu64" late_avg_us %"PRId64" late_max_us %"PRId64"\n",
+			counter->name[0] ? counter->name : "-", counter->type,
+			counter->count,
+			counter->late_total_usecs / (int64_t)counter->count,
+			counter->late_max_usecs);
+	}
+}
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Force feedback (--ff <input> --vibrate <trigger>:<key>:<pattern>):
+ * <input> is one of our inputs, opened read-write. Rumble effects are
+ * uploaded to it whenever it is (re)opened, then played by writing an
+ * EV_FF event to the same fd, without spawning anything.
+ *
+ * <trigger> is the same as for --blink, and <pattern> is
+ * <length ms>,<strong %>,<weak %> for the two rumble motors.
+ * The kernel frees effects when the fd is closed, so a reopened input
+ * gets them again; effect ids are kept across hot upgrades as the fd is.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "buttond.h"
+
+struct ff {
+	const char *path;
+	/* index in input_files */
+	int input;
+};
+
+struct vibration {
+	enum feedback_trigger trigger;
+	uint16_t code;
+	int ff;
+	int length_msecs;
+	int strong;
+	int weak;
+	/* uploaded effect, -1 if not (yet) */
+	int16_t id;
+	/* do not retry uploading until the input is reopened */
+	bool upload_failed;
+};
+
+void ff_add(struct state *state, const char *path) {
+	state->ffs = xreallocarray(state->ffs, state->ff_count + 1,
+				   sizeof(*state->ffs));
+	struct ff *ff = &state->ffs[state->ff_count++];
+	ff->path = path;
+	ff->input = -1;
+}
+
+void ff_add_vibration(struct state *state, char *spec) {
+	xassert(state->ff_count, "--vibrate can only be set after --ff");
+
+	char *key = strchr(spec, ':');
+	char *pattern = key ? strchr(key + 1, ':') : NULL;
+	xassert(pattern, "--vibrate expects <trigger>:<key>:<length ms>,<strong %%>,<weak %%>, got %s",
+		spec);
+	*key++ = 0;
+	*pattern++ = 0;
+
+	state->vibrations = xreallocarray(state->vibrations,
+					  state->vibration_count + 1,
+					  sizeof(*state->vibrations));
+	struct vibration *vibration = &state->vibrations[state->vibration_count++];
+	memset(vibration, 0, sizeof(*vibration));
+	vibration->ff = state->ff_count - 1;
+	vibration->id = -1;
+	vibration->trigger = feedback_trigger("--vibrate", spec);
+	vibration->code = feedback_key("--vibrate", key);
+	xassert(sscanf(pattern, "%d,%d,%d", &vibration->length_msecs,
+		       &vibration->strong, &vibration->weak) == 3
+		&& vibration->length_msecs > 0
+		&& vibration->length_msecs <= 0x7fff
+		&& vibration->strong >= 0 && vibration->strong <= 100
+		&& vibration->weak >= 0 && vibration->weak <= 100,
+		"--vibrate: invalid pattern %s", pattern);
+}
+
+static int ff_fd(struct state *state, struct ff *ff) {
+	return state->pollfds[ff->input].fd;
+}
+
+static void vibration_upload(struct state *state,
+			     struct vibration *vibration) {
+	struct ff *ff = &state->ffs[vibration->ff];
+	struct ff_effect effect = {
+		.type = FF_RUMBLE,
+		.id = -1,
+		.u.rumble = {
+			.strong_magnitude = vibration->strong * 0xffff / 100,
+			.weak_magnitude = vibration->weak * 0xffff / 100,
+		},
+		.replay.length = vibration->length_msecs,
+	};
+
+	if (ioctl(ff_fd(state, ff), EVIOCSFF, &effect) != 0) {
+		fprintf(stderr, "Could not upload effect to %s: %m\n", ff->path);
+		vibration->upload_failed = true;
+		return;
+	}
+	vibration->id = effect.id;
+}
+
+/* bind --ff devices to their input once configuration is complete,
+ * effects are uploaded when inputs are opened */
+void ff_start(struct state *state) {
+	for (int i = 0; i < state->ff_count; i++) {
+		struct ff *ff = &state->ffs[i];
+
+		for (int j = 0; j < state->input_count; j++) {
+			if (strcmp(state->input_files[j].filename, ff->path) == 0)
+				ff->input = j;
+		}
+		xassert(ff->input >= 0, "--ff %s is not one of the inputs",
+			ff->path);
+		state->input_files[ff->input].ff = true;
+	}
+}
+
+/* input i was (re)opened: previous effects went away with the old fd */
+void ff_input_opened(struct state *state, int i) {
+	for (int v = 0; v < state->vibration_count; v++) {
+		struct vibration *vibration = &state->vibrations[v];
+
+		if (state->ffs[vibration->ff].input != i)
+			continue;
+		vibration->id = -1;
+		vibration->upload_failed = false;
+		vibration_upload(state, vibration);
+	}
+}
+
+void ff_save(struct state *state, int fd) {
+	for (int i = 0; i < state->vibration_count; i++) {
+		if (state->vibrations[i].id >= 0)
+			dprintf(fd, "vibration %d %d\n", i, state->vibrations[i].id);
+	}
+}
+
+/* before inputs are restored: dropped ones are reopened and upload again */
+void ff_restore(struct state *state, const char *line) {
+	int i, id;
+
+	if (sscanf(line, "vibration %d %d", &i, &id) != 2
+	    || i < 0 || i >= state->vibration_count || id < 0 || id > INT16_MAX)
+		return;
+	state->vibrations[i].id = id;
+}
+
+static void vibration_trigger(struct state *state, struct buttond_key *key,
+			      enum feedback_trigger trigger) {
+	for (int i = 0; i < state->vibration_count; i++) {
+		struct vibration *vibration = &state->vibrations[i];
+		struct ff *ff = &state->ffs[vibration->ff];
+
+		if (vibration->code != key->code || vibration->trigger != trigger)
+			continue;
+		/* input is gone until inotify reopens it */
+		if (ff_fd(state, ff) < 0)
+			continue;
+		/* upgraded from a buttond that did not save effect ids */
+		if (vibration->id < 0 && !vibration->upload_failed)
+			vibration_upload(state, vibration);
+		if (vibration->id < 0)
+			continue;
+		if (state->ctx.debug > 1)
+			log_printf("vibrating %s for %d ms\n", ff->path,
+				   vibration->length_msecs);
+		struct input_event event = {
+			.type = EV_FF,
+			.code = vibration->id,
+			.value = 1,
+		};
+		if (write(ff_fd(state, ff), &event, sizeof(event)) < 0 && state->ctx.debug)
+			log_printf("could not play effect on %s: %m\n", ff->path);
+	}
+}
+
+void ff_key_transition(struct state *state, struct buttond_key *key,
+		       enum buttond_key_state old_state) {
+	if (old_state == BUTTOND_KEY_RELEASED && key->state == BUTTOND_KEY_PRESSED)
+		vibration_trigger(state, key, FEEDBACK_PRESS);
+}
+
+void ff_key_stage(struct state *state, struct buttond_key *key) {
+	vibration_trigger(state, key, FEEDBACK_THRESHOLD);
+}
+
+void ff_action_done(struct state *state, struct buttond_key *key) {
+	vibration_trigger(state, key, FEEDBACK_DONE);
+}
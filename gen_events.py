@@ -1,31 +1,172 @@
 #!/usr/bin/env python3
 
+import fcntl
+import glob
+import os
+import select
 import struct
 import sys
-from time import clock_gettime_ns, CLOCK_MONOTONIC, sleep
+import threading
+from time import clock_gettime_ns, CLOCK_MONOTONIC, monotonic, sleep
 
-def gen_event(key, state):
+EV_SYN = 0
+EV_KEY = 1
+EV_FF = 0x15
+EV_UINPUT = 0x0101
+FF_RUMBLE = 0x50
+UI_FF_UPLOAD = 1
+UI_FF_ERASE = 2
+
+UI_DEV_CREATE = 0x5501
+UI_DEV_DESTROY = 0x5502
+UI_DEV_SETUP = 0x405c5503  # _IOW('U', 3, struct uinput_setup)
+UI_SET_EVBIT = 0x40045564
+UI_SET_KEYBIT = 0x40045565
+UI_SET_FFBIT = 0x4004556b
+UI_BEGIN_FF_UPLOAD = 0xc06855c8  # struct uinput_ff_upload, 104 bytes
+UI_END_FF_UPLOAD = 0x406855c9
+UI_BEGIN_FF_ERASE = 0xc00c55ca  # struct uinput_ff_erase, 12 bytes
+UI_END_FF_ERASE = 0x400c55cb
+EVENT_SIZE = struct.calcsize('LLHHi')
+
+# events go to stdout (a pipe for buttond --test_mode) or to a uinput
+# device with --uinput
+uinput_fd = None
+uinput_done = threading.Event()
+
+
+def ui_get_sysname(length):
+    # _IOC(_IOC_READ, 'U', 44, len)
+    return (2 << 30) | (length << 16) | (ord('U') << 8) | 44
+
+
+def gen_event(key, state, type=EV_KEY):
     ts = clock_gettime_ns(CLOCK_MONOTONIC)
-    sys.stdout.buffer.write(struct.pack('LLHHI',
+    event = struct.pack('LLHHi',
             int(ts / 1000000000), (int(ts/1000) % 1000000),
-            1, key, state))
+            type, key, state)
+    if uinput_fd is not None:
+        # timestamps are set by the kernel, evdev delivers on SYN_REPORT
+        os.write(uinput_fd, event + struct.pack('LLHHi', 0, 0, EV_SYN, 0, 0))
+        return
+    sys.stdout.buffer.write(event)
     sys.stdout.buffer.flush()
 
 
+def uinput_ff_serve(log):
+    """answer effect uploads and log played effect ids to log, one per line"""
+    while not uinput_done.is_set():
+        if not select.select([uinput_fd], [], [], 0.1)[0]:
+            continue
+        data = os.read(uinput_fd, EVENT_SIZE * 16)
+        for off in range(0, len(data) - EVENT_SIZE + 1, EVENT_SIZE):
+            _, _, type, code, value = struct.unpack_from('LLHHi', data, off)
+            if type == EV_UINPUT and code == UI_FF_UPLOAD:
+                request = bytearray(struct.pack('Ii', value, 0) + bytes(96))
+                fcntl.ioctl(uinput_fd, UI_BEGIN_FF_UPLOAD, request)
+                struct.pack_into('i', request, 4, 0)
+                fcntl.ioctl(uinput_fd, UI_END_FF_UPLOAD, bytes(request))
+            elif type == EV_UINPUT and code == UI_FF_ERASE:
+                request = bytearray(struct.pack('IiI', value, 0, 0))
+                fcntl.ioctl(uinput_fd, UI_BEGIN_FF_ERASE, request)
+                struct.pack_into('i', request, 4, 0)
+                fcntl.ioctl(uinput_fd, UI_END_FF_ERASE, bytes(request))
+            elif type == EV_FF and value:
+                with open(log, 'a') as f:
+                    f.write(f'play {code}\n')
+
+
+def uinput_create(events, path, ff_log=None):
+    """create a device for keys used in events, write its event node to path,
+    with --ff-log it also has rumble effects"""
+    global uinput_fd
+    uinput_fd = os.open('/dev/uinput', os.O_RDWR)
+    fcntl.ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY)
+    if ff_log:
+        fcntl.ioctl(uinput_fd, UI_SET_EVBIT, EV_FF)
+        fcntl.ioctl(uinput_fd, UI_SET_FFBIT, FF_RUMBLE)
+    for fields in events:
+        if len(fields) == 3:
+            fcntl.ioctl(uinput_fd, UI_SET_KEYBIT, fields[0])
+        elif fields[0] == EV_KEY:
+            fcntl.ioctl(uinput_fd, UI_SET_KEYBIT, fields[1])
+    # struct uinput_setup: input_id (bustype BUS_VIRTUAL), name, ff_effects_max
+    fcntl.ioctl(uinput_fd, UI_DEV_SETUP,
+                struct.pack('HHHH80sI', 6, 1, 1, 1, b'buttond-test',
+                            16 if ff_log else 0))
+    fcntl.ioctl(uinput_fd, UI_DEV_CREATE)
+    if ff_log:
+        # uploads block buttond until answered, even before it is ready
+        threading.Thread(target=uinput_ff_serve, args=(ff_log,),
+                         daemon=True).start()
+    sysname = fcntl.ioctl(uinput_fd, ui_get_sysname(64), bytes(64))
+    sysname = sysname.split(b'\0')[0].decode()
+    # node shows up once devtmpfs/udev created it
+    deadline = monotonic() + 5
+    while monotonic() < deadline:
+        nodes = glob.glob(f'/sys/devices/virtual/input/{sysname}/event*')
+        if nodes and os.path.exists('/dev/input/' + os.path.basename(nodes[0])):
+            with open(path + '.tmp', 'w') as f:
+                f.write('/dev/input/' + os.path.basename(nodes[0]))
+            os.rename(path + '.tmp', path)
+            return
+        sleep(0.01)
+    sys.exit(f'no event node for {sysname}')
+
+
+def wait_ready(path):
+    # buttond --ready-fd writes a newline to path once inputs are open,
+    # give up after a while in case it failed to start
+    deadline = monotonic() + 10
+    while monotonic() < deadline:
+        try:
+            if os.path.getsize(path) > 0:
+                return
+        except FileNotFoundError:
+            pass
+        sleep(0.01)
+
+
 def main():
-    # wait some for buttond init
-    sleep(1)
-    for command in sys.argv[1:]:
+    args = sys.argv[1:]
+    ready = None
+    uinput = None
+    ff_log = None
+    while args[:1] in (['--ready'], ['--uinput'], ['--ff-log']):
+        if args[0] == '--ready':
+            ready = args[1]
+        elif args[0] == '--uinput':
+            uinput = args[1]
+        else:
+            ff_log = args[1]
+        args = args[2:]
+    if uinput:
+        uinput_create([[int(field) for field in command.split(',')]
+                       for command in args], uinput, ff_log)
+    if ready:
+        wait_ready(ready)
+    else:
+        # wait some for buttond init
+        sleep(1)
+    for command in args:
         try:
-            [key, state, time] = command.split(',')
-            gen_event(int(key), int(state))
-            sleep(int(time)/1000)
+            # key,state,time or type,code,value,time
+            fields = [int(field) for field in command.split(',')]
+            if len(fields) == 4:
+                gen_event(fields[1], fields[2], fields[0])
+            else:
+                [key, state, time] = fields
+                gen_event(key, state)
+            sleep(fields[-1]/1000)
         except ValueError:
             sys.stdout.buffer.write(command.encode('utf-8'))
             sys.stdout.buffer.flush()
             sleep(0.1)
     # ... and some more for debouncing
     sleep(1)
+    if uinput_fd is not None:
+        uinput_done.set()
+        fcntl.ioctl(uinput_fd, UI_DEV_DESTROY)
 
 if __name__ == '__main__':
     main()
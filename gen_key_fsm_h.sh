@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# compile key_fsm.spec into a transition table, see spec for format
+
+SPEC="${1:-key_fsm.spec}"
+
+cat <<EOF
+// SPDX-License-Identifier: MIT
+// GENERATED FILE! from key_fsm.spec by gen_key_fsm_h.sh
+
+#ifndef BUTTOND_KEY_FSM_H
+#define BUTTOND_KEY_FSM_H
+
+EOF
+awk '
+	function field(prefix, value) {
+		return value == "-" ? prefix "NONE" : prefix value;
+	}
+	/^[ \t]*(#|$)/ { next; }
+	NF != 6 {
+		printf("%s:%d: expected 6 fields, got %d\n", FILENAME, FNR, NF) > "/dev/stderr";
+		failed = 1;
+		next;
+	}
+	{
+		if (!($1 in states)) {
+			states[$1] = 1;
+			state_order[state_count++] = $1;
+		}
+		if (!($2 in inputs)) {
+			inputs[$2] = 1;
+			input_order[input_count++] = $2;
+		}
+		if (($1, $2) in table) {
+			printf("%s:%d: %s %s defined twice\n", FILENAME, FNR, $1, $2) > "/dev/stderr";
+			failed = 1;
+		}
+		table[$1, $2] = sprintf("{ %s, %s, %s, %s }",
+			$3 == "-" ? "KEY_STATE_SAME" : "BUTTOND_KEY_" $3,
+			field("STAMP_", $4), field("TIMER_", $5),
+			field("DISPATCH_", $6));
+	}
+	END {
+		if (failed)
+			exit 1;
+		printf("static const struct key_fsm_entry key_fsm[][KEY_INPUT_COUNT] = {\n");
+		for (s = 0; s < state_count; s++) {
+			state = state_order[s];
+			printf("\t[BUTTOND_KEY_%s] = {\n", state);
+			for (i = 0; i < input_count; i++) {
+				input = input_order[i];
+				if (!((state, input) in table)) {
+					printf("%s: missing %s %s\n", FILENAME, state, input) > "/dev/stderr";
+					exit 1;
+				}
+				printf("\t\t[KEY_INPUT_%s] = %s,\n", input, table[state, input]);
+			}
+			printf("\t},\n");
+		}
+		printf("};\n");
+	}' "$SPEC" || exit 1
+
+cat <<EOF
+
+#endif
+EOF
@@ -18,7 +18,7 @@ cat <<EOF
 EOF
 $AWK '/^#define KEY_/ { $3=$3+0; if ($3) { gsub(/KEY_/, "", $2); keys[$3] = $2; }}
 	END {
-		printf("const char allkeynames[] =\n  \"");
+		printf("static const char allkeynames[] =\n  \"");
 		max = 0;
 		for (key in keys) {
 			key=key+0; # cast to int
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Idle actions (--idle <time ms>:<command>): run <command> once no
+ * event was read from the watched inputs for <time>, and the optional
+ * --idle-resume command on the next event after that.
+ * Each idle is a daemon timer pushed back on every input read.
+ */
+
+#include <string.h>
+
+#include "buttond.h"
+
+struct idle {
+	struct timer timer;
+	int msecs;
+	const char *action;
+	const char *resume;
+	/* --idle-input filenames, resolved to input indices by idle_start */
+	const char **input_names;
+	int input_name_count;
+	/* per input, NULL if all inputs are watched */
+	bool *inputs;
+	/* action ran, resume pending */
+	bool idle;
+};
+
+static void idle_run(struct state *state, struct idle *idle,
+		     const char *command, const char *type) {
+	if (!command || !command[0])
+		return;
+	/* resume runs right after rearming, deadline is only ours for idle */
+	if (dry_run_action(NULL, type, idle->msecs,
+			   strcmp(type, "idle") == 0 ? &idle->timer.deadline : NULL,
+			   command))
+		return;
+	if (state->ctx.debug)
+		log_printf("running %s\n", command);
+	spawn_set_env(NULL, type, idle->msecs);
+	spawn_wait(command);
+}
+
+static void idle_fire(struct state *state, struct timer *timer) {
+	struct idle *idle = (struct idle *)timer;
+
+	if (state->ctx.debug)
+		log_printf("idle for %d ms\n", idle->msecs);
+	idle->idle = true;
+	idle_run(state, idle, idle->action, "idle");
+}
+
+void idle_add(struct state *state, char *spec) {
+	char *action;
+	int msecs = strtol(spec, &action, 10);
+
+	xassert(msecs > 0 && action[0] == ':',
+		"--idle expects <time ms>:<command>, got %s", spec);
+	state->idles = xreallocarray(state->idles, state->idle_count + 1,
+				     sizeof(*state->idles));
+	struct idle *idle = &state->idles[state->idle_count++];
+	memset(idle, 0, sizeof(*idle));
+	idle->msecs = msecs;
+	idle->action = action + 1;
+}
+
+static struct idle *last_idle(struct state *state, const char *option) {
+	xassert(state->idle_count,
+		"%s can only be set after --idle", option);
+	return &state->idles[state->idle_count - 1];
+}
+
+void idle_set_resume(struct state *state, const char *command) {
+	last_idle(state, "--idle-resume")->resume = command;
+}
+
+void idle_add_input(struct state *state, const char *filename) {
+	struct idle *idle = last_idle(state, "--idle-input");
+
+	idle->input_names = xreallocarray(idle->input_names,
+			idle->input_name_count + 1,
+			sizeof(*idle->input_names));
+	idle->input_names[idle->input_name_count++] = filename;
+}
+
+/* resolve inputs and arm all idle timers, must be called once inputs
+ * are known and before upgrade_restore */
+void idle_start(struct state *state, const struct timespec *now) {
+	for (int i = 0; i < state->idle_count; i++) {
+		struct idle *idle = &state->idles[i];
+
+		/* array can no longer move: timers point into it */
+		timer_register(state, &idle->timer, idle_fire);
+		timer_arm(&idle->timer, now, idle->msecs);
+		if (!idle->input_name_count)
+			continue;
+		idle->inputs = xcalloc(state->input_count, sizeof(*idle->inputs));
+		for (int n = 0; n < idle->input_name_count; n++) {
+			int j;
+			for (j = 0; j < state->input_count; j++) {
+				if (strcmp(state->input_files[j].filename,
+					   idle->input_names[n]) == 0)
+					break;
+			}
+			xassert(j < state->input_count,
+				"--idle-input %s is not an input", idle->input_names[n]);
+			idle->inputs[j] = true;
+		}
+		free(idle->input_names);
+		idle->input_names = NULL;
+	}
+}
+
+/* called on every input read: only pushes deadlines back unless idle */
+void idle_activity(struct state *state, int input,
+		   const struct timespec *now) {
+	for (int i = 0; i < state->idle_count; i++) {
+		struct idle *idle = &state->idles[i];
+
+		if (idle->inputs && !idle->inputs[input])
+			continue;
+		timer_arm(&idle->timer, now, idle->msecs);
+		if (!idle->idle)
+			continue;
+		idle->idle = false;
+		if (state->ctx.debug)
+			log_printf("activity resumed after idle\n");
+		idle_run(state, idle, idle->resume, "resume");
+	}
+}
+
+void idle_save(struct state *state, int fd) {
+	for (int i = 0; i < state->idle_count; i++) {
+		struct idle *idle = &state->idles[i];
+		dprintf(fd, "idle %d %d %d %lld %ld\n", i, idle->idle,
+			idle->timer.armed,
+			(long long)idle->timer.deadline.tv_sec,
+			(long)idle->timer.deadline.tv_nsec);
+	}
+}
+
+void idle_restore(struct state *state, const char *line) {
+	int i, is_idle, armed;
+	long long sec;
+	long nsec;
+
+	if (sscanf(line, "idle %d %d %d %lld %ld",
+		   &i, &is_idle, &armed, &sec, &nsec) != 5
+	    || i < 0 || i >= state->idle_count)
+		return;
+	struct idle *idle = &state->idles[i];
+	idle->idle = is_idle;
+	idle->timer.armed = armed;
+	idle->timer.deadline.tv_sec = sec;
+	idle->timer.deadline.tv_nsec = nsec;
+}
@@ -14,6 +14,9 @@
 // for simple cases
 #define INOTIFY_WATCH_FLAGS (IN_CREATE|IN_DELETE_SELF)
 
+/* at most one "events read late" warning per input in that time */
+#define LAG_WARN_INTERVAL_MSECS 10000
+
 static void mkdir_one(char *path, char *rest) {
 	if (access(path, F_OK) == 0) {
 		return;
@@ -56,7 +59,7 @@ static bool is_bit_set(unsigned char *bitmap, int code) {
 /* refresh currently down keys after open */
 static void check_pressed_keys(struct state *state, int fd) {
 	/* not applicable to pipes in tests... */
-	if (test_mode)
+	if (state->test_mode)
 		return;
 
 	unsigned char key_states[KEY_MAX/8 + 1] = { 0 };
@@ -64,44 +67,56 @@ static void check_pressed_keys(struct state *state, int fd) {
 	max = ioctl(fd, EVIOCGKEY(sizeof(key_states)), key_states);
 	xassert(max >= 0, "EVIOCGKEY failed: %m");
 	max = max * 8;
+	/* for held: guards, also covers unconfigured keys */
+	for (size_t i = 0; i < sizeof(key_states) && i < sizeof(state->ctx.held); i++)
+		state->ctx.held[i] |= key_states[i];
 
-	if (debug > 1) {
+	if (state->ctx.debug > 1) {
 		for (int i = 0; i < KEY_MAX; i++) {
 			if (!is_bit_set(key_states, i))
 				continue;
-			printf("key %s (%d) was up on open\n",
-				keyname_by_code(i), i);
+			log_printf("key %s (%d) was up on open\n",
+				buttond_keyname(i), i);
 		}
 	}
 
-	for (int i = 0; i < state->key_count; i++) {
-		struct key *key = &state->keys[i];
-		if (key->code > max)
+	struct timespec now;
+	time_gettime(&now);
+	for (int i = 0; i < state->ctx.key_count; i++) {
+		struct buttond_key *key = &state->ctx.keys[i];
+		if (key->code >= max)
 			continue;
 		if (is_bit_set(key_states, key->code)) {
-			if (debug == 1) {
-				printf("key %s (%d) was up on open\n",
-					keyname_by_code(key->code), key->code);
+			if (state->ctx.debug == 1) {
+				log_printf("key %s (%d) was up on open\n",
+					key->name, key->code);
 			}
-			arm_key_press(key, true);
+			if (!snapshot_restore_key(state, key))
+				buttond_arm_key(&state->ctx, key, &now);
 		}
 	}
 }
 
-/* return 1 if something was done */
-static int inotify_watch(struct input_file *input_file,
-			  struct pollfd *inotify) {
-	/* already setup - nothing to do! */
-	if (input_file->inotify_wd >= 0)
-		return 0;
+/* setup inotify if not done yet */
+int inotify_fd(struct state *state) {
+	struct pollfd *inotify = pollfd_slot(state, POLLFD_INOTIFY);
 
-	/* setup inotify if not done yet */
 	if (!inotify->events) {
 		inotify->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 		xassert(inotify->fd >= 0,
 			"Inotify init failed: %m");
 		inotify->events = POLLIN;
 	}
+	return inotify->fd;
+}
+
+/* return 1 if something was done */
+static int inotify_watch(struct state *state, struct input_file *input_file) {
+	/* already setup - nothing to do! */
+	if (input_file->inotify_wd >= 0)
+		return 0;
+
+	int fd = inotify_fd(state);
 
 	fprintf(stderr, "setting up inotify watch for %s\n",
 		input_file->filename);
@@ -125,7 +140,7 @@ static int inotify_watch(struct input_file *input_file,
 	bool retried = false;
 again:
 	input_file->inotify_wd =
-		inotify_add_watch(inotify->fd, watch_dir, INOTIFY_WATCH_FLAGS);
+		inotify_add_watch(fd, watch_dir, INOTIFY_WATCH_FLAGS | IN_MASK_ADD);
 	if (input_file->inotify_wd < 0 && errno == ENOENT && !retried) {
 		/* directory didn't exist, try to create it and create a dummy file in there
 		 * so udev doesn't delete it under us.
@@ -148,41 +163,56 @@ again:
 	return 1;
 }
 
+/* --ff devices need write access to upload and play effects, test
+ * pipes must stay read-only or we would never see EOF */
+static int open_input(struct state *state, struct input_file *input_file) {
+	if (!input_file->ff || state->test_mode)
+		return open(input_file->filename,
+			    O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	int fd = open(input_file->filename, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0 && errno == EACCES) {
+		fprintf(stderr, "Could not open %s read-write, no force feedback: %m\n",
+			input_file->filename);
+		fd = open(input_file->filename,
+			  O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+	return fd;
+}
+
 void reopen_input(struct state *state, int i) {
 	struct input_file *input_file = &state->input_files[i];
 	struct pollfd *pollfd = &state->pollfds[i];
-	struct pollfd *inotify = &state->pollfds[state->input_count];
 	if (pollfd->fd >= 0) {
+		input_file->reopens++;
+		readers_remove(state, i);
 		close(pollfd->fd);
 		pollfd->fd = -1;
 		pollfd->events = 0;
 	}
-	int fd = open(input_file->filename,
-		      O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	int fd = open_input(state, input_file);
 	if (fd < 0) {
 		xassert(errno == ENOENT,
 			"Open %s failed: %m", input_file->filename);
 		xassert(input_file->dirent,
 			"%s: %m.\nInotify is not enabled, aborting.",
 			input_file->filename);
-		if (inotify_watch(input_file, inotify) == 0)
+		if (inotify_watch(state, input_file) == 0)
 			return;
 		/* this was racy: retry to open here, just in case. */
-		fd = open(input_file->filename,
-			  O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		fd = open_input(state, input_file);
 		if (fd < 0)
 			return;
 	}
 	int clock = CLOCK_MONOTONIC;
 	/* we use a pipe for testing which won't understand this */
-	if (!test_mode && ioctl(fd, EVIOCSCLOCKID, &clock) != 0) {
+	if (!state->test_mode && ioctl(fd, EVIOCSCLOCKID, &clock) != 0) {
 		close(fd);
 		fprintf(stderr,
 			"Could not request clock monotonic timestamps from %s. Ignoring this file.\n",
 			input_file->filename);
 		if (input_file->dirent)
-			inotify_watch(input_file, inotify);
-		else if (debug < 2)
+			inotify_watch(state, input_file);
+		else if (state->ctx.debug < 2)
 			xassert(input_file->dirent,
 				"Inotify not enabled for this file: aborting");
 		return;
@@ -191,9 +221,13 @@ void reopen_input(struct state *state, int i) {
 
 	pollfd->fd = fd;
 	pollfd->events = POLLIN;
+	ff_input_opened(state, i);
+	readers_add(state, i);
 }
 
 static void handle_inotify_event(struct state *state, struct inotify_event *event) {
+	conditions_inotify_event(state, event);
+
 	/* skip events we don't care about */
 	if (!(event->mask & INOTIFY_WATCH_FLAGS))
 		return;
@@ -203,14 +237,13 @@ static void handle_inotify_event(struct state *state, struct inotify_event *even
 		/* find inputs concerned */
 		if (event->wd != input_file->inotify_wd)
 			continue;
-		if (debug > 2) {
-			printf("got inotify event for %s's directory (%s): %x\n",
-			       input_file->filename, event->name, event->mask);
+		if (state->ctx.debug > 2) {
+			log_printf("got inotify event for %s's directory (%s): %x\n",
+				   input_file->filename, event->name, event->mask);
 		}
 		if ((event->mask & IN_DELETE_SELF)) {
 			input_file->inotify_wd = -1;
-			inotify_watch(input_file,
-				      &state->pollfds[state->input_count]);
+			inotify_watch(state, input_file);
 			/* we might have been raced there with yet another
 			 * re-creation, so also try to reopen even if it likely
 			 * won't work: continue here */
@@ -218,8 +251,8 @@ static void handle_inotify_event(struct state *state, struct inotify_event *even
 			/* was it a filename we care about? */
 			continue;
 
-		if (debug) {
-			printf("trying to reopen %s\n",
+		if (state->ctx.debug) {
+			log_printf("trying to reopen %s\n",
 					input_file->filename);
 		}
 		reopen_input(state, i);
@@ -228,7 +261,7 @@ static void handle_inotify_event(struct state *state, struct inotify_event *even
 }
 
 void handle_inotify(struct state *state) {
-	int fd = state->pollfds[state->input_count].fd;
+	int fd = pollfd_slot(state, POLLFD_INOTIFY)->fd;
 	struct inotify_event *event;
 	/* read more at a time. Align because man page example does... */
 	char buf[4096]
@@ -251,71 +284,74 @@ void handle_inotify(struct state *state) {
 	xassert(n >= 0, "Did not read expected amount from inotify fd: %d", n);
 }
 
-static void print_key(struct input_event *event, const char *filename,
-		      const char *message) {
-	if (debug < 1)
+/* events sit in the evdev buffer when we are too busy to read them,
+ * which skews press durations: keep track of how late they are */
+static void input_lag(struct state *state, int i, struct input_event *events,
+		      int count, const struct timespec *now) {
+	struct input_file *input_file = &state->input_files[i];
+	struct input_lag *lag = &input_file->lag;
+	int64_t max = 0;
+
+	for (int e = 0; e < count; e++) {
+		int64_t usecs = (now->tv_sec - events[e].input_event_sec) * USECS_IN_SEC
+			+ now->tv_nsec / NSECS_IN_USEC - events[e].input_event_usec;
+		if (usecs < 0)
+			usecs = 0;
+		metrics_event_lag(usecs);
+		lag->total_usecs += usecs;
+		if (usecs > max)
+			max = usecs;
+		if (state->lag_warn_msecs
+		    && usecs >= state->lag_warn_msecs * USECS_IN_MSEC)
+			lag->late++;
+	}
+	lag->events += count;
+	if (max > lag->max_usecs)
+		lag->max_usecs = max;
+
+	if (!state->lag_warn_msecs
+	    || max < state->lag_warn_msecs * USECS_IN_MSEC)
 		return;
-	switch (event->type) {
-	case 0:
-		/* extra info pertaining previous event: don't print */
+	/* rate limited, the counter has the full story */
+	if (lag->last_warning.tv_sec
+	    && time_diff_ts(now, &lag->last_warning) < LAG_WARN_INTERVAL_MSECS)
 		return;
-	case 1:
-		printf("[%ld.%03ld] %s%s%s (%d) %s: %s\n",
-		       event->input_event_sec, event->input_event_usec / 1000,
-		       debug > 2 ? filename : "",
-		       debug > 2 ? " " : "",
-		       keyname_by_code(event->code), event->code,
-		       event->value ? "pressed" : "released",
-		       message);
-		break;
-	default:
-		printf("[%ld.%03ld] %s%s%d %d %d: %s\n",
-		       event->input_event_sec, event->input_event_usec / 1000,
-		       debug > 2 ? filename : "",
-		       debug > 2 ? " " : "",
-		       event->type, event->code, event->value,
-		       message);
-	}
+	lag->last_warning = *now;
+	fprintf(stderr, "%s: events read %"PRId64" ms late (%"PRIu64" late events so far)\n",
+		input_file->filename, max / USECS_IN_MSEC, lag->late);
 }
 
+/* events read from input i at now, directly or by a reader thread */
+void input_events(struct state *state, int i, struct input_event *events,
+		  int count, const struct timespec *now) {
+	const char *filename = state->input_files[i].filename;
 
-static void handle_input_event(struct state *state,
-			       struct input_event *event,
-			       const char *filename) {
-	/* ignore non-keyboard events */
-	if (event->type != 1) {
-		if (debug > 2)
-			print_key(event, filename, "non-keyboard event ignored");
-		return;
-	}
-
-	struct key *key = NULL;
-	for (int i = 0; i < state->key_count; i++) {
-		if (state->keys[i].code == event->code) {
-			key = &state->keys[i];
-			break;
-		}
+	input_lag(state, i, events, count, now);
+	for (struct input_event *event = events; event < events + count; event++) {
+		PROBE4(event_read, i, event->type, event->code, event->value);
+		recorder_event(i, event);
+		if (state->rel_count
+		    && (event->type == EV_REL || event->type == EV_SYN))
+			rel_handle_event(state, event, filename);
+		/* before the key event so BTN_TOUCH also ends zones */
+		if (state->abs_count && event->type != EV_REL)
+			abs_handle_event(state, event, filename);
+		buttond_handle_event(&state->ctx, event, filename);
 	}
-	/* ignore unconfigured key */
-	if (!key) {
-		if (debug > 1)
-			print_key(event, filename, "ignored");
-		return;
-	}
-	print_key(event, filename, "processing");
-
-	handle_key(state, event, key);
 }
 
-
 int handle_input(struct state *state, int i) {
 	int fd = state->pollfds[i].fd;
-	const char *filename = state->input_files[i].filename;
 	struct input_event *event;
 	char buf[4096]
 		__attribute__ ((aligned(__alignof__(*event))));
 	int n = 0;
 
+	if (state->idle_count) {
+		struct timespec now;
+		time_gettime(&now);
+		idle_activity(state, i, &now);
+	}
 	while ((n = read_safe(fd, &buf, sizeof(buf))) > 0) {
 		if (n % sizeof(*event) != 0) {
 			fprintf(stderr,
@@ -323,11 +359,10 @@ int handle_input(struct state *state, int i) {
 				n, sizeof(*event));
 			return -1;
 		}
-		for (event = (struct input_event*)buf;
-		     (char*)event + sizeof(event) <= buf + n;
-		     event++) {
-			handle_input_event(state, event, filename);
-		}
+		struct timespec now;
+		time_gettime(&now);
+		input_events(state, i, (struct input_event *)buf,
+			     n / sizeof(*event), &now);
 	}
 	if (n < 0) {
 		fprintf(stderr, "read error: %d. Trying to reopen\n", -n);
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: MIT
+// GENERATED FILE! from key_fsm.spec by gen_key_fsm_h.sh
+
+#ifndef BUTTOND_KEY_FSM_H
+#define BUTTOND_KEY_FSM_H
+
+static const struct key_fsm_entry key_fsm[][KEY_INPUT_COUNT] = {
+	[BUTTOND_KEY_RELEASED] = {
+		[KEY_INPUT_DOWN] = { BUTTOND_KEY_PRESSED, STAMP_PRESS, TIMER_STAGE, DISPATCH_NONE },
+		[KEY_INPUT_UP] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_REPEAT] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_WAKEUP] = { BUTTOND_KEY_HANDLED, STAMP_RELEASE_NOW, TIMER_CLEAR, DISPATCH_HELD },
+		[KEY_INPUT_WAKEUP_STAGE] = { KEY_STATE_SAME, STAMP_RELEASE_NOW, TIMER_STAGE, DISPATCH_STAGES },
+	},
+	[BUTTOND_KEY_PRESSED] = {
+		[KEY_INPUT_DOWN] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_UP] = { BUTTOND_KEY_DEBOUNCE, STAMP_RELEASE, TIMER_DEBOUNCE, DISPATCH_NONE },
+		[KEY_INPUT_REPEAT] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_WAKEUP] = { BUTTOND_KEY_HANDLED, STAMP_RELEASE_NOW, TIMER_CLEAR, DISPATCH_HELD },
+		[KEY_INPUT_WAKEUP_STAGE] = { KEY_STATE_SAME, STAMP_RELEASE_NOW, TIMER_STAGE, DISPATCH_STAGES },
+	},
+	[BUTTOND_KEY_DEBOUNCE] = {
+		[KEY_INPUT_DOWN] = { BUTTOND_KEY_PRESSED, STAMP_NONE, TIMER_STAGE, DISPATCH_NONE },
+		[KEY_INPUT_UP] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_REPEAT] = { BUTTOND_KEY_PRESSED, STAMP_NONE, TIMER_STAGE, DISPATCH_NONE },
+		[KEY_INPUT_WAKEUP] = { BUTTOND_KEY_RELEASED, STAMP_NONE, TIMER_CLEAR, DISPATCH_RELEASED },
+		[KEY_INPUT_WAKEUP_STAGE] = { BUTTOND_KEY_RELEASED, STAMP_NONE, TIMER_CLEAR, DISPATCH_RELEASED },
+	},
+	[BUTTOND_KEY_HANDLED] = {
+		[KEY_INPUT_DOWN] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_UP] = { BUTTOND_KEY_RELEASED, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_REPEAT] = { KEY_STATE_SAME, STAMP_NONE, TIMER_NONE, DISPATCH_NONE },
+		[KEY_INPUT_WAKEUP] = { BUTTOND_KEY_HANDLED, STAMP_RELEASE_NOW, TIMER_CLEAR, DISPATCH_HELD },
+		[KEY_INPUT_WAKEUP_STAGE] = { KEY_STATE_SAME, STAMP_RELEASE_NOW, TIMER_STAGE, DISPATCH_STAGES },
+	},
+};
+
+#endif
@@ -0,0 +1,46 @@
+# Key state machine, compiled into key_fsm.h by gen_key_fsm_h.sh.
+#
+# One line per state and input, all combinations must be listed:
+#   <state> <input> <next state> <stamp> <timer> <dispatch>
+# with '-' for no change/nothing to do.
+#
+# inputs: DOWN, UP and REPEAT are key events (value 1, 0, 2),
+#   WAKEUP the key's wakeup time was reached, WAKEUP_STAGE same with
+#   long press stages still to come.
+# stamp: PRESS records event time as press time (new press),
+#   RELEASE event time as release time, RELEASE_NOW current time as
+#   release time (key still held when its long press triggers).
+# timer: STAGE arms next long press stage, DEBOUNCE arms debounce
+#   time after release, CLEAR removes wakeup.
+# dispatch (on wakeup): STAGES reports stages reached, HELD also runs
+#   the matching action, RELEASED runs the matching action or cancels
+#   the last stage reached. The state is changed before actions run.
+
+# state	input		next		stamp		timer		dispatch
+RELEASED	DOWN		PRESSED		PRESS		STAGE		-
+RELEASED	UP		-		-		-		-
+# autorepeat of a key held before a layer switch
+RELEASED	REPEAT		-		-		-		-
+RELEASED	WAKEUP		HANDLED		RELEASE_NOW	CLEAR		HELD
+RELEASED	WAKEUP_STAGE	-		RELEASE_NOW	STAGE		STAGES
+
+PRESSED		DOWN		-		-		-		-
+# debounce: action is decided on wakeup
+PRESSED		UP		DEBOUNCE	RELEASE		DEBOUNCE	-
+PRESSED		REPEAT		-		-		-		-
+PRESSED		WAKEUP		HANDLED		RELEASE_NOW	CLEAR		HELD
+PRESSED		WAKEUP_STAGE	-		RELEASE_NOW	STAGE		STAGES
+
+# pressed again before debounce time: same press, keeping its time
+DEBOUNCE	DOWN		PRESSED		-		STAGE		-
+DEBOUNCE	UP		-		-		-		-
+DEBOUNCE	REPEAT		PRESSED		-		STAGE		-
+DEBOUNCE	WAKEUP		RELEASED	-		CLEAR		RELEASED
+DEBOUNCE	WAKEUP_STAGE	RELEASED	-		CLEAR		RELEASED
+
+# long press ran while held: wait for release
+HANDLED		DOWN		-		-		-		-
+HANDLED		UP		RELEASED	-		-		-
+HANDLED		REPEAT		-		-		-		-
+HANDLED		WAKEUP		HANDLED		RELEASE_NOW	CLEAR		HELD
+HANDLED		WAKEUP_STAGE	-		RELEASE_NOW	STAGE		STAGES
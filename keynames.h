@@ -5,7 +5,7 @@
 #define BUTTOND_KEYNAMES_H
 
 
-const char allkeynames[] =
+static const char allkeynames[] =
   "ESC\0001\0002\0003\0004\0005\0006\0007\0008\0009\0000\000MINUS\000"
   "EQUAL\000BACKSPACE\000TAB\000Q\000W\000E\000R\000T\000Y\000U\000I\000O\000"
   "P\000LEFTBRACE\000RIGHTBRACE\000ENTER\000LEFTCTRL\000A\000S\000D\000F\000"
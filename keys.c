@@ -1,13 +1,67 @@
+// SPDX-License-Identifier: MIT
+
 #include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include "buttond.h"
+#include "libbuttond.h"
+#include "probes.h"
+#include "time_utils.h"
 #include "keynames.h"
 
+/* inputs of the key state machine, see key_fsm.spec */
+enum key_input {
+	KEY_INPUT_DOWN,
+	KEY_INPUT_UP,
+	KEY_INPUT_REPEAT,
+	KEY_INPUT_WAKEUP,
+	KEY_INPUT_WAKEUP_STAGE,
+	KEY_INPUT_COUNT,
+};
+
+enum key_stamp {
+	STAMP_NONE,
+	STAMP_PRESS,
+	STAMP_RELEASE,
+	STAMP_RELEASE_NOW,
+};
+
+enum key_timer {
+	TIMER_NONE,
+	TIMER_STAGE,
+	TIMER_DEBOUNCE,
+	TIMER_CLEAR,
+};
+
+enum key_dispatch {
+	DISPATCH_NONE,
+	DISPATCH_STAGES,
+	DISPATCH_HELD,
+	DISPATCH_RELEASED,
+};
+
+#define KEY_STATE_SAME -1
+
+struct key_fsm_entry {
+	int8_t next;
+	uint8_t stamp;
+	uint8_t timer;
+	uint8_t dispatch;
+};
+
+#include "key_fsm.h"
+
 static const char *keynames[KEY_MAX];
+static const char *virtual_keynames[BUTTOND_MAX_VIRTUAL_KEYS];
+static int virtual_key_count;
 
-void init_keynames(void) {
+static void init_keynames(void) {
 	size_t idx = 0;
+	/* already done? */
+	if (keynames[1])
+		return;
 	/* starts at 1... */
 	for (int i = 1;
 	     i < KEY_MAX && idx < sizeof(allkeynames);
@@ -16,7 +70,46 @@ void init_keynames(void) {
 	}
 }
 
-uint16_t find_key_by_name(char *arg) {
+__attribute__((format(printf, 3, 4)))
+static void ctx_log(struct buttond_ctx *ctx, int level, const char *fmt, ...) {
+	va_list ap;
+
+	if (level > ctx->debug)
+		return;
+	va_start(ap, fmt);
+	if (ctx->ops && ctx->ops->log) {
+		ctx->ops->log(ctx, level, fmt, ap);
+	} else {
+		vfprintf(level ? stdout : stderr, fmt, ap);
+	}
+	va_end(ap);
+}
+
+void buttond_init(struct buttond_ctx *ctx, const struct buttond_ops *ops,
+		  void *data) {
+	init_keynames();
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->debounce_msecs = BUTTOND_DEFAULT_DEBOUNCE_MSECS;
+	ctx->ops = ops;
+	ctx->data = data;
+}
+
+void buttond_free(struct buttond_ctx *ctx) {
+	for (int l = 0; l < ctx->layer_count; l++) {
+		struct buttond_layer *layer = &ctx->layers[l];
+		for (int i = 0; i < layer->key_count; i++)
+			free(layer->keys[i].actions);
+		free(layer->keys);
+	}
+	free(ctx->layers);
+	ctx->layers = NULL;
+	ctx->layer_count = 0;
+	ctx->keys = NULL;
+	ctx->key_count = 0;
+}
+
+uint16_t buttond_key_by_name(char *arg) {
+	init_keynames();
 	/* XXX if this is too slow try to optimize later, but list is not so big */
 	for (int i = 0; arg[i]; i++) {
 		/* We require ASCII name anyway: make it uppercase to match header.
@@ -30,15 +123,207 @@ uint16_t find_key_by_name(char *arg) {
 			return i;
 		}
 	}
+	for (int i = 0; i < virtual_key_count; i++) {
+		if (strcmp(virtual_keynames[i], arg) == 0)
+			return KEY_CNT + i;
+	}
 	return 0;
 }
 
-const char *keyname_by_code(uint16_t code) {
-	if (code > KEY_MAX || !keynames[code])
+const char *buttond_keyname(uint16_t code) {
+	if (code >= KEY_CNT && code < KEY_CNT + virtual_key_count)
+		return virtual_keynames[code - KEY_CNT];
+	if (code >= KEY_MAX || !keynames[code])
 		return "unknown";
 	return keynames[code];
 }
 
+uint16_t buttond_add_virtual_key(char *name) {
+	if (virtual_key_count >= BUTTOND_MAX_VIRTUAL_KEYS
+	    || buttond_key_by_name(name))
+		return 0;
+	virtual_keynames[virtual_key_count] = name;
+	return KEY_CNT + virtual_key_count++;
+}
+
+static struct buttond_key *layer_find_key(struct buttond_layer *layer, uint16_t code) {
+	for (int i = 0; i < layer->key_count; i++) {
+		if (layer->keys[i].code == code)
+			return &layer->keys[i];
+	}
+	return NULL;
+}
+
+struct buttond_key *buttond_find_key(struct buttond_ctx *ctx, uint16_t code) {
+	for (int i = 0; i < ctx->key_count; i++) {
+		if (ctx->keys[i].code == code)
+			return &ctx->keys[i];
+	}
+	return NULL;
+}
+
+int buttond_find_layer(struct buttond_ctx *ctx, const char *name) {
+	for (int i = 0; i < ctx->layer_count; i++) {
+		if (strcmp(ctx->layers[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int buttond_add_layer(struct buttond_ctx *ctx, const char *name) {
+	int idx = buttond_find_layer(ctx, name);
+
+	/* default layer always comes first */
+	if (idx < 0 && ctx->layer_count == 0 && strcmp(name, "default")) {
+		int rc = buttond_add_layer(ctx, "default");
+		if (rc)
+			return rc;
+	}
+	if (idx < 0) {
+		void *ptr = realloc(ctx->layers,
+			(ctx->layer_count + 1) * sizeof(*ctx->layers));
+		if (!ptr)
+			return -ENOMEM;
+		ctx->layers = ptr;
+		idx = ctx->layer_count++;
+		memset(&ctx->layers[idx], 0, sizeof(ctx->layers[idx]));
+		ctx->layers[idx].name = name;
+	}
+	ctx->config_layer = idx;
+	return 0;
+}
+
+struct buttond_action *buttond_add_action(struct buttond_ctx *ctx,
+					  uint16_t code,
+					  enum buttond_action_type type,
+					  int trigger_time) {
+	if (ctx->layer_count == 0 && buttond_add_layer(ctx, "default"))
+		return NULL;
+
+	struct buttond_layer *layer = &ctx->layers[ctx->config_layer];
+	struct buttond_key *key = layer_find_key(layer, code);
+	void *ptr;
+
+	if (!key) {
+		ptr = realloc(layer->keys, (layer->key_count + 1) * sizeof(*layer->keys));
+		if (!ptr)
+			return NULL;
+		layer->keys = ptr;
+		key = &layer->keys[layer->key_count];
+		layer->key_count++;
+		memset(key, 0, sizeof(*key));
+		key->code = code;
+		key->name = buttond_keyname(code);
+		key->state = BUTTOND_KEY_RELEASED;
+	}
+	ptr = realloc(key->actions, (key->action_count + 1) * sizeof(*key->actions));
+	if (!ptr)
+		return NULL;
+	key->actions = ptr;
+
+	/* insert at the end, we'll sort in buttond_finalize */
+	struct buttond_action *action = &key->actions[key->action_count];
+	key->action_count++;
+	memset(action, 0, sizeof(*action));
+	action->type = type;
+	action->trigger_time = trigger_time;
+	action->switch_layer = -1;
+	return action;
+}
+
+int buttond_add_guard(struct buttond_action *action, enum buttond_guard_type type,
+		      bool negate, int arg, const char *layer_name) {
+	for (int i = 0; i < BUTTOND_MAX_GUARDS; i++) {
+		struct buttond_guard *guard = &action->guards[i];
+		if (guard->type != BUTTOND_GUARD_NONE)
+			continue;
+		guard->type = type;
+		guard->negate = negate;
+		guard->arg = arg;
+		guard->layer_name = layer_name;
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+static int sort_actions_compare(const void *v1, const void *v2) {
+	const struct buttond_action *a1 = (const struct buttond_action*)v1;
+	const struct buttond_action *a2 = (const struct buttond_action*)v2;
+	if (a1->type == BUTTOND_SHORT_PRESS)
+		return -1;
+	if (a2->type == BUTTOND_SHORT_PRESS)
+		return 1;
+	if (a1->trigger_time < a2->trigger_time)
+		return -1;
+	if (a1->trigger_time > a2->trigger_time)
+		return 1;
+	return 0;
+}
+
+static int finalize_layer(struct buttond_ctx *ctx, struct buttond_layer *layer) {
+	for (int i = 0; i < layer->key_count; i++) {
+		struct buttond_key *key = &layer->keys[i];
+		qsort(key->actions, key->action_count,
+		      sizeof(key->actions[0]), sort_actions_compare);
+		for (int j = 0; j < key->action_count; j++) {
+			struct buttond_action *action = &key->actions[j];
+			for (int g = 0; g < BUTTOND_MAX_GUARDS; g++) {
+				struct buttond_guard *guard = &action->guards[g];
+				if (guard->type != BUTTOND_GUARD_LAYER)
+					continue;
+				guard->arg = buttond_find_layer(ctx, guard->layer_name);
+				if (guard->arg < 0) {
+					ctx_log(ctx, 0, "Key %s checks undefined layer %s\n",
+						key->name, guard->layer_name);
+					return -EINVAL;
+				}
+			}
+			if (!action->switch_layer_name)
+				continue;
+			action->switch_layer = buttond_find_layer(ctx,
+					action->switch_layer_name);
+			if (action->switch_layer < 0) {
+				ctx_log(ctx, 0, "Key %s switches to undefined layer %s\n",
+					key->name, action->switch_layer_name);
+				return -EINVAL;
+			}
+		}
+		for (int j = 1; j < key->action_count; j++) {
+			struct buttond_action *a1, *a2;
+			a1 = &key->actions[j-1];
+			a2 = &key->actions[j];
+			if (a1->type != a2->type && a1->trigger_time > a2->trigger_time) {
+				ctx_log(ctx, 0, "Key %s had a short key (%d) longer than its shortest long key (%d)\n",
+					key->name, a1->trigger_time,
+					a2->trigger_time);
+				return -EINVAL;
+			}
+			if (a1->type == a2->type && a1->trigger_time == a2->trigger_time) {
+				ctx_log(ctx, 0, "Key %s was defined twice with %d ms %s action\n",
+					key->name, a1->trigger_time,
+					a1->type == BUTTOND_SHORT_PRESS ? "short" : "long");
+				return -EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+int buttond_finalize(struct buttond_ctx *ctx) {
+	for (int l = 0; l < ctx->layer_count; l++) {
+		int rc = finalize_layer(ctx, &ctx->layers[l]);
+		if (rc)
+			return rc;
+	}
+	ctx->layer = 0;
+	ctx->config_layer = 0;
+	if (ctx->layer_count) {
+		ctx->keys = ctx->layers[0].keys;
+		ctx->key_count = ctx->layers[0].key_count;
+	}
+	return 0;
+}
+
 static void tv_from_event(struct timeval *tv, struct input_event *event) {
 	/* input_event has a timeval struct on 64bit systems,
 	 * but it is not guaranteed so copy manually
@@ -47,109 +332,309 @@ static void tv_from_event(struct timeval *tv, struct input_event *event) {
 	tv->tv_usec = event->input_event_usec;
 }
 
-void arm_key_press(struct key *key, bool reset_pressed) {
-	key->state = KEY_PRESSED;
+static void set_state(struct buttond_ctx *ctx, struct buttond_key *key,
+		      enum buttond_key_state new_state) {
+	enum buttond_key_state old_state = key->state;
 
+	key->state = new_state;
+	PROBE3(key_state, key->code, old_state, new_state);
+	if (ctx->ops && ctx->ops->transition)
+		ctx->ops->transition(ctx, key, old_state);
+}
+
+/* long press action with the smallest trigger_time after time, or the
+ * last one if stages are not reported. NULL if none left */
+static struct buttond_action *next_stage(struct buttond_ctx *ctx,
+					 struct buttond_key *key, int time) {
 	/* short action is always first, so if last action is not LONG there
-	 * are none. We only set a timeout if we have one.*/
-	struct action *action = &key->actions[key->action_count-1];
-	if (action->type != LONG_PRESS) {
+	 * are none. */
+	struct buttond_action *last = &key->actions[key->action_count-1];
+	if (last->type != BUTTOND_LONG_PRESS || last->trigger_time <= time)
+		return NULL;
+	if (!ctx->ops || !ctx->ops->stage)
+		return last;
+
+	struct buttond_action *next = last;
+	for (int i = 0; i < key->action_count; i++) {
+		struct buttond_action *action = &key->actions[i];
+		if (action->type == BUTTOND_LONG_PRESS && action->trigger_time > time
+		    && action->trigger_time < next->trigger_time)
+			next = action;
+	}
+	return next;
+}
+
+static void arm_next_stage(struct buttond_ctx *ctx, struct buttond_key *key) {
+	struct buttond_action *action = next_stage(ctx, key, key->stage_time);
+
+	/* We only set a timeout if we have one. */
+	if (!action) {
 		key->has_wakeup = false;
+		PROBE3(key_arm, key->code, 0, 0);
 		return;
 	}
 	key->has_wakeup = true;
-	if (reset_pressed) {
-		time_gettime(&key->ts_wakeup);
-		time_ts2tv(&key->tv_pressed, &key->ts_wakeup, 0);
-                time_add_ts(&key->ts_wakeup, action->trigger_time);
-	} else {
-		time_tv2ts(&key->ts_wakeup, &key->tv_pressed,
-			   action->trigger_time);
-	}
+	time_tv2ts(&key->ts_wakeup, &key->tv_pressed, action->trigger_time);
+	PROBE3(key_arm, key->code, key->ts_wakeup.tv_sec, key->ts_wakeup.tv_nsec);
 }
 
-void handle_key(struct state *state, struct input_event *event,
-		struct key *key) {
-	switch (key->state) {
-	case KEY_RELEASED:
-	case KEY_DEBOUNCE:
-		/* new key press -- can be a release if program started with key or handled long press */
-		if (event->value == 0)
-			break;
+/* if now is set the key is considered pressed at that time,
+ * otherwise tv_pressed has been filled by caller */
+static void arm_key_press(struct buttond_ctx *ctx, struct buttond_key *key,
+			  const struct timespec *now) {
+	if (now)
+		time_ts2tv(&key->tv_pressed, now, 0);
+	/* debounced presses keep stages already reached */
+	if (key->state == BUTTOND_KEY_RELEASED)
+		key->stage_time = 0;
 
-		/* don't reset timestamp/wakeup on debounce */
-		if (key->state == KEY_RELEASED) {
-			tv_from_event(&key->tv_pressed, event);
-		}
-		arm_key_press(key, false);
-		break;
-	case KEY_PRESSED:
-		/* ignore repress */
-		if (event->value != 0)
-			break;
-		/* mark key for debounce, we will handle event after timeout */
-		key->state = KEY_DEBOUNCE;
-		tv_from_event(&key->tv_released, event);
-		key->has_wakeup = true;
-		time_gettime(&key->ts_wakeup);
-		time_add_ts(&key->ts_wakeup, state->debounce_msecs);
+	arm_next_stage(ctx, key);
+	set_state(ctx, key, BUTTOND_KEY_PRESSED);
+}
+
+void buttond_arm_key(struct buttond_ctx *ctx, struct buttond_key *key,
+		     const struct timespec *now) {
+	ctx_log(ctx, 4, "arming key %s (%d)\n", key->name, key->code);
+	arm_key_press(ctx, key, now);
+}
+
+void buttond_resume_key(struct buttond_ctx *ctx, struct buttond_key *key,
+			const struct timespec *pressed, bool handled) {
+	ctx_log(ctx, 4, "resuming key %s (%d)%s\n", key->name, key->code,
+		handled ? ", already handled" : "");
+	arm_key_press(ctx, key, pressed);
+	if (!handled)
+		return;
+	key->has_wakeup = false;
+	PROBE3(key_arm, key->code, 0, 0);
+	set_state(ctx, key, BUTTOND_KEY_HANDLED);
+}
+
+static void key_step(struct buttond_ctx *ctx, struct buttond_key *key,
+		     enum key_input input, struct input_event *event,
+		     const char *source, const struct timespec *now);
+
+void buttond_set_layer(struct buttond_ctx *ctx, int layer) {
+	if (layer < 0 || layer >= ctx->layer_count || layer == ctx->layer)
+		return;
+
+	/* forget about keys held in old layer: their release will go to
+	 * the new layer, and they should not be pressed when coming back */
+	for (int i = 0; i < ctx->key_count; i++) {
+		struct buttond_key *key = &ctx->keys[i];
+		key->has_wakeup = false;
+		if (key->state != BUTTOND_KEY_RELEASED)
+			set_state(ctx, key, BUTTOND_KEY_RELEASED);
+	}
+	ctx_log(ctx, 1, "switching to layer %s\n", ctx->layers[layer].name);
+	ctx->layer = layer;
+	ctx->keys = ctx->layers[layer].keys;
+	ctx->key_count = ctx->layers[layer].key_count;
+}
+
+static void print_key(struct buttond_ctx *ctx, int level,
+		      struct input_event *event, const char *source,
+		      const char *message) {
+	if (ctx->debug < level)
+		return;
+	if (!source || ctx->debug < 3)
+		source = "";
+	switch (event->type) {
+	case EV_SYN:
+		/* extra info pertaining previous event: don't print */
+		return;
+	case EV_KEY:
+		ctx_log(ctx, level, "[%ld.%03ld] %s%s%s (%d) %s: %s\n",
+			(long)event->input_event_sec,
+			(long)event->input_event_usec / 1000,
+			source, source[0] ? " " : "",
+			buttond_keyname(event->code), event->code,
+			event->value ? "pressed" : "released",
+			message);
 		break;
-	case KEY_HANDLED:
-		/* ignore until key down */
-		if (event->value != 0)
-			break;
-		key->state = KEY_RELEASED;
+	default:
+		ctx_log(ctx, level, "[%ld.%03ld] %s%s%d %d %d: %s\n",
+			(long)event->input_event_sec,
+			(long)event->input_event_usec / 1000,
+			source, source[0] ? " " : "",
+			event->type, event->code, event->value,
+			message);
 	}
 }
 
-int compute_timeout(struct key *keys, int key_count) {
-	int i;
+void buttond_handle_event(struct buttond_ctx *ctx, struct input_event *event,
+			  const char *source) {
+	/* ignore non-keyboard events */
+	if (event->type != EV_KEY) {
+		if (event->type != EV_SYN)
+			ctx->ignored_events++;
+		print_key(ctx, 3, event, source, "non-keyboard event ignored");
+		return;
+	}
+	if (event->code < BUTTOND_KEY_CNT) {
+		if (event->value)
+			ctx->held[event->code / 8] |= 1 << (event->code % 8);
+		else
+			ctx->held[event->code / 8] &= ~(1 << (event->code % 8));
+	}
+
+	struct buttond_key *key = buttond_find_key(ctx, event->code);
+	/* ignore unconfigured key */
+	if (!key) {
+		ctx->ignored_events++;
+		print_key(ctx, 2, event, source, "ignored");
+		return;
+	}
+	print_key(ctx, 1, event, source, "processing");
+
+	/* any other value is a press, as for autorepeat */
+	enum key_input input = event->value == 0 ? KEY_INPUT_UP
+		: event->value == 2 ? KEY_INPUT_REPEAT : KEY_INPUT_DOWN;
+	key_step(ctx, key, input, event, source, NULL);
+}
+
+int buttond_next_timeout(struct buttond_ctx *ctx, const struct timespec *now) {
 	int timeout = -1;
-	struct timespec ts;
-	time_gettime(&ts);
+	const struct timespec *next = NULL;
 
-	for (i = 0; i < key_count; i++) {
-		if (keys[i].has_wakeup) {
-			int64_t diff = time_diff_ts(&keys[i].ts_wakeup, &ts);
+	for (int i = 0; i < ctx->key_count; i++) {
+		struct buttond_key *key = &ctx->keys[i];
+		if (key->has_wakeup) {
+			int64_t diff = time_diff_ts(&key->ts_wakeup, now);
 			if (diff < 0)
 				timeout = 0;
 			else if (timeout == -1 || diff < timeout)
 				timeout = diff;
+			if (!next || time_diff_ts(&key->ts_wakeup, next) < 0)
+				next = &key->ts_wakeup;
 		}
 	}
-	if (debug > 3) {
+	/* once per change: we are called on every poll, and the message
+	 * itself makes the next poll return at once */
+	struct timespec wakeup = next ? *next : (struct timespec){ .tv_sec = -1 };
+	if (!ctx->wakeup_logged
+	    || wakeup.tv_sec != ctx->logged_wakeup.tv_sec
+	    || wakeup.tv_nsec != ctx->logged_wakeup.tv_nsec) {
+		ctx->wakeup_logged = true;
+		ctx->logged_wakeup = wakeup;
 		if (timeout >= 0) {
-			printf("wakeup scheduled in %d\n", timeout);
+			ctx_log(ctx, 4, "wakeup scheduled in %d\n", timeout);
 		} else {
-			printf("no wakeup scheduled\n");
+			ctx_log(ctx, 4, "no wakeup scheduled\n");
 		}
 	}
 
 	return timeout;
 }
 
-static bool action_match(struct action *action, int time) {
+static bool action_match(struct buttond_action *action, int time) {
 	switch (action->type) {
-	case LONG_PRESS:
+	case BUTTOND_LONG_PRESS:
 		return time >= action->trigger_time;
-	case SHORT_PRESS:
+	case BUTTOND_SHORT_PRESS:
 		return time < action->trigger_time;
 	default:
-		xassert(false, "invalid action!!");
+		return false;
+	}
+}
+
+static bool guards_pass(struct buttond_ctx *ctx, struct buttond_action *action) {
+	for (int i = 0; i < BUTTOND_MAX_GUARDS; i++) {
+		struct buttond_guard *guard = &action->guards[i];
+		bool met;
+
+		switch (guard->type) {
+		case BUTTOND_GUARD_NONE:
+			return true;
+		case BUTTOND_GUARD_CONDITION:
+			met = guard->arg < ctx->condition_count
+				&& ctx->conditions[guard->arg];
+			break;
+		case BUTTOND_GUARD_LAYER:
+			met = guard->arg == ctx->layer;
+			break;
+		case BUTTOND_GUARD_HELD:
+			met = buttond_key_held(ctx, guard->arg);
+			break;
+		default:
+			met = false;
+		}
+		if (met == guard->negate)
+			return false;
+	}
+	return true;
+}
+
+/* cooldown and rate limit, as a token bucket in its GCRA form (one
+ * timestamp per action): tat is when the bucket will be full again.
+ * tv is when the action triggered. */
+static bool rate_pass(struct buttond_action *action, const struct timeval *tv) {
+	int64_t now = (int64_t)tv->tv_sec * USECS_IN_SEC + tv->tv_usec;
+	int64_t tat = 0;
+
+	if (action->cooldown && action->last_run_usecs
+	    && now - action->last_run_usecs < (int64_t)action->cooldown * USECS_IN_MSEC)
+		goto suppressed;
+	if (action->rate_count) {
+		int64_t interval = (int64_t)action->rate_msecs * USECS_IN_MSEC
+			/ action->rate_count;
+
+		tat = action->rate_tat_usecs > now ? action->rate_tat_usecs : now;
+		if (tat - now > (int64_t)action->rate_msecs * USECS_IN_MSEC - interval)
+			goto suppressed;
+		tat += interval;
+	}
+	action->last_run_usecs = now;
+	action->rate_tat_usecs = tat;
+	return true;
+
+suppressed:
+	action->suppressed++;
+	return false;
+}
+
+/* report long press stages reached since last wakeup */
+static void report_stages(struct buttond_ctx *ctx, struct buttond_key *key,
+			  int64_t time) {
+	struct buttond_action *action;
+
+	if (!ctx->ops || !ctx->ops->stage)
+		return;
+	while ((action = next_stage(ctx, key, key->stage_time))
+	       && action->trigger_time <= time) {
+		key->stage_time = action->trigger_time;
+		ctx_log(ctx, 2, "key %s (%d) reached %d ms stage\n",
+			key->name, key->code, action->trigger_time);
+		ctx->ops->stage(ctx, key, action, time);
 	}
 }
 
-static struct action *find_key_action(struct key *key, int time) {
+static struct buttond_action *find_stage_action(struct buttond_key *key) {
+	for (int i = 0; i < key->action_count; i++) {
+		if (key->actions[i].type == BUTTOND_LONG_PRESS
+		    && key->actions[i].trigger_time == key->stage_time)
+			return &key->actions[i];
+	}
+	return NULL;
+}
+
+/* action that only reports its stage */
+static bool action_is_noop(struct buttond_action *action) {
+	return (!action->action || !action->action[0])
+		&& action->switch_layer < 0 && !action->exit_after;
+}
+
+static struct buttond_action *find_key_action(struct buttond_key *key, int time) {
 	/* check short keys in growing order, then long keys in
 	 * decreasing order to get the best match */
 	for (int i = 0; i < key->action_count; i++) {
-		if (key->actions[i].type != SHORT_PRESS)
+		if (key->actions[i].type != BUTTOND_SHORT_PRESS)
 			break;
 		if (action_match(&key->actions[i], time))
 			return &key->actions[i];
 	}
 	for (int i = key->action_count - 1; i >= 0; i--) {
-		if (key->actions[i].type != LONG_PRESS)
+		if (key->actions[i].type != BUTTOND_LONG_PRESS)
 			break;
 		if (action_match(&key->actions[i], time))
 			return &key->actions[i];
@@ -157,59 +642,135 @@ static struct action *find_key_action(struct key *key, int time) {
 	return NULL;
 }
 
-void handle_timeouts(struct key *keys, int key_count) {
-	int i;
-	struct timespec ts;
-	time_gettime(&ts);
+/* what a wakeup decided, only run once the key state changed */
+struct key_run {
+	int64_t time;
+	struct buttond_action *action;
+	struct buttond_action *cancel;
+};
 
-	for (i = 0; i < key_count; i++) {
-		if (keys[i].has_wakeup
-		    && (time_diff_ts(&keys[i].ts_wakeup, &ts) <= 0)) {
-			if (debug > 3)
-				printf("we are %ld ahead of timeout\n",
-				       time_diff_ts(&keys[i].ts_wakeup, &ts));
+static void key_run_prepare(struct buttond_ctx *ctx, struct buttond_key *key,
+			    enum key_dispatch dispatch, struct key_run *run) {
+	run->time = time_diff_tv(&key->tv_released, &key->tv_pressed);
+	if (dispatch != DISPATCH_RELEASED)
+		report_stages(ctx, key, run->time);
+	if (dispatch == DISPATCH_STAGES)
+		return;
+	run->action = find_key_action(key, run->time);
+	if (dispatch == DISPATCH_RELEASED && key->stage_time
+	    && (!run->action || action_is_noop(run->action)))
+		run->cancel = find_stage_action(key);
+}
 
-			if (keys[i].state != KEY_DEBOUNCE) {
-				/* key still pressed - set artifical release time */
-				time_ts2tv(&keys[i].tv_released, &ts, 0);
-			}
+static void key_run(struct buttond_ctx *ctx, struct buttond_key *key,
+		    struct key_run *run) {
+	struct buttond_action *action = run->action;
+	int64_t diff = run->time;
 
-			int64_t diff = time_diff_tv(&keys[i].tv_released,
-						    &keys[i].tv_pressed);
-			struct action *action = find_key_action(&keys[i], diff);
-			if (action) {
-				/* special keys can have no action */
-				if (action->action && action->action[0]) {
-					if (debug)
-						printf("running %s after %"PRId64" ms\n",
-						       action->action, diff);
-					system(action->action);
-				}
-				if (action->exit_after) {
-					if (debug && keys[i].code)
-						printf("Exiting after processing key %s (%d)\n",
-						       keyname_by_code(keys[i].code),
-						       keys[i].code);
-					else if (debug)
-						printf("Exiting after stop timeout\n");
-					exit(0);
-				}
-			} else if (keys[i].state != KEY_DEBOUNCE) {
-				fprintf(stderr,
-					"Woke up for key %s (%d) after %"PRId64" ms without any associated action, this should not happen!\n",
-					keyname_by_code(keys[i].code),
-					keys[i].code, diff);
-			} else if (debug) {
-				printf("ignoring key %s (%d) released after %"PRId64" ms\n",
-				       keyname_by_code(keys[i].code),
-				       keys[i].code, diff);
-			}
+	if (action && !guards_pass(ctx, action)) {
+		ctx_log(ctx, 1,
+			"not running action for key %s (%d) after %"PRId64" ms: guard not met\n",
+			key->name, key->code, diff);
+	} else if (action && !rate_pass(action, &key->tv_released)) {
+		ctx_log(ctx, 1,
+			"not running action for key %s (%d) after %"PRId64" ms: rate limited (%"PRIu64" suppressed)\n",
+			key->name, key->code, diff, action->suppressed);
+	} else if (action) {
+		if (ctx->ops && ctx->ops->action)
+			ctx->ops->action(ctx, key, action, diff);
+		if (action->switch_layer >= 0)
+			buttond_set_layer(ctx, action->switch_layer);
+	} else if (key->state != BUTTOND_KEY_RELEASED) {
+		ctx_log(ctx, 0,
+			"Woke up for key %s (%d) after %"PRId64" ms without any associated action, this should not happen!\n",
+			key->name, key->code, diff);
+	} else if (!run->cancel) {
+		ctx_log(ctx, 1,
+			"ignoring key %s (%d) released after %"PRId64" ms\n",
+			key->name, key->code, diff);
+	}
+	if (run->cancel) {
+		ctx_log(ctx, 1,
+			"key %s (%d) released after %"PRId64" ms: cancelling %d ms stage\n",
+			key->name, key->code, diff, run->cancel->trigger_time);
+		if (ctx->ops->cancel)
+			ctx->ops->cancel(ctx, key, run->cancel, diff);
+	}
+}
 
-			keys[i].has_wakeup = false;
-			if (keys[i].state == KEY_DEBOUNCE)
-				keys[i].state = KEY_RELEASED;
-			else
-				keys[i].state = KEY_HANDLED;
-		}
+/* one transition of key_fsm: event is set for key events, now for
+ * wakeups */
+static void key_step(struct buttond_ctx *ctx, struct buttond_key *key,
+		     enum key_input input, struct input_event *event,
+		     const char *source, const struct timespec *now) {
+	const struct key_fsm_entry *entry = &key_fsm[key->state][input];
+	struct key_run run = { 0 };
+
+	switch (entry->stamp) {
+	case STAMP_PRESS:
+		tv_from_event(&key->tv_pressed, event);
+		key->source = source;
+		key->stage_time = 0;
+		break;
+	case STAMP_RELEASE:
+		/* event timestamps are monotonic so no need to ask the time */
+		tv_from_event(&key->tv_released, event);
+		break;
+	case STAMP_RELEASE_NOW:
+		time_ts2tv(&key->tv_released, now, 0);
+		break;
+	}
+	if (entry->dispatch != DISPATCH_NONE)
+		key_run_prepare(ctx, key, entry->dispatch, &run);
+	switch (entry->timer) {
+	case TIMER_STAGE:
+		arm_next_stage(ctx, key);
+		break;
+	case TIMER_DEBOUNCE:
+		key->has_wakeup = true;
+		time_tv2ts(&key->ts_wakeup, &key->tv_released,
+			   ctx->debounce_msecs);
+		break;
+	case TIMER_CLEAR:
+		key->has_wakeup = false;
+		break;
+	}
+	/* before running actions, they might not return */
+	if (entry->next != KEY_STATE_SAME)
+		set_state(ctx, key, entry->next);
+	if (entry->dispatch == DISPATCH_HELD
+	    || entry->dispatch == DISPATCH_RELEASED)
+		key_run(ctx, key, &run);
+}
+
+/* held keys wake up for each reported stage, the last one is final */
+static enum key_input wakeup_input(struct buttond_ctx *ctx, struct buttond_key *key,
+				   const struct timespec *now) {
+	struct timeval tv_now;
+
+	if (!ctx->ops || !ctx->ops->stage)
+		return KEY_INPUT_WAKEUP;
+	time_ts2tv(&tv_now, now, 0);
+	return next_stage(ctx, key, time_diff_tv(&tv_now, &key->tv_pressed))
+		? KEY_INPUT_WAKEUP_STAGE : KEY_INPUT_WAKEUP;
+}
+
+void buttond_handle_timeouts(struct buttond_ctx *ctx,
+			     const struct timespec *now) {
+	/* actions can switch layer: keep iterating on the old one */
+	struct buttond_key *keys = ctx->keys;
+	int key_count = ctx->key_count;
+
+	for (int i = 0; i < key_count; i++) {
+		struct buttond_key *key = &keys[i];
+
+		if (!key->has_wakeup
+		    || time_diff_ts(&key->ts_wakeup, now) > 0)
+			continue;
+
+		ctx_log(ctx, 4, "we are %ld ahead of timeout\n",
+			time_diff_ts(&key->ts_wakeup, now));
+
+		key_step(ctx, key, wakeup_input(ctx, key, now), NULL, NULL, now);
 	}
 }
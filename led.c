@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: MIT
+/*
+ * LED feedback (--led <target> --blink <trigger>:<key>:<pattern>):
+ * blink patterns are played by daemon timers, without spawning
+ * anything.
+ *
+ * <target> is either a sysfs brightness file, or an evdev device and
+ * LED separated by a colon (e.g. /dev/input/event0:LED_CAPSL) in which
+ * case EV_LED events are written to the device.
+ * <trigger> is press (key goes down), threshold (key held past each of
+ * its long press times, see stage callback) or done (one of its actions completed), and
+ * <pattern> is <on ms>,<off ms>,<count>.
+ * A new pattern on a LED replaces the one being played, the LED is
+ * left off at the end of a pattern.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "buttond.h"
+
+struct led {
+	const char *target;
+	int fd;
+	/* EV_LED code, -1 for sysfs */
+	int code;
+	/* sysfs value for on, max_brightness if available */
+	char on[16];
+	/* pattern being played */
+	struct timer timer;
+	int on_msecs;
+	int off_msecs;
+	/* on/off toggles left */
+	int toggles;
+	bool lit;
+};
+
+struct blink {
+	enum feedback_trigger trigger;
+	uint16_t code;
+	int led;
+	int on_msecs;
+	int off_msecs;
+	int count;
+};
+
+static const char *led_names[] = {
+	[LED_NUML] = "LED_NUML",
+	[LED_CAPSL] = "LED_CAPSL",
+	[LED_SCROLLL] = "LED_SCROLLL",
+	[LED_COMPOSE] = "LED_COMPOSE",
+	[LED_KANA] = "LED_KANA",
+	[LED_SLEEP] = "LED_SLEEP",
+	[LED_SUSPEND] = "LED_SUSPEND",
+	[LED_MUTE] = "LED_MUTE",
+	[LED_MISC] = "LED_MISC",
+	[LED_MAIL] = "LED_MAIL",
+	[LED_CHARGING] = "LED_CHARGING",
+};
+
+static int led_code(const char *name) {
+	for (size_t i = 0; i < sizeof(led_names) / sizeof(led_names[0]); i++) {
+		if (led_names[i] && strcasecmp(led_names[i], name) == 0)
+			return i;
+	}
+	int code = strtoint(name);
+	if (errno || code > LED_MAX)
+		return -1;
+	return code;
+}
+
+/* shared with --vibrate */
+enum feedback_trigger feedback_trigger(const char *option, const char *name) {
+	if (strcmp(name, "press") == 0)
+		return FEEDBACK_PRESS;
+	if (strcmp(name, "threshold") == 0)
+		return FEEDBACK_THRESHOLD;
+	xassert(strcmp(name, "done") == 0, "%s: unknown trigger %s", option, name);
+	return FEEDBACK_DONE;
+}
+
+uint16_t feedback_key(const char *option, char *name) {
+	uint16_t code = buttond_key_by_name(name);
+
+	if (!code)
+		code = strtou16(name);
+	xassert(code, "%s: invalid key %s", option, name);
+	return code;
+}
+
+static void led_set(struct state *state, struct led *led, bool lit) {
+	led->lit = lit;
+	if (led->fd < 0)
+		return;
+	if (led->code >= 0) {
+		struct input_event events[2] = {
+			{ .type = EV_LED, .code = led->code, .value = lit },
+			{ .type = EV_SYN, .code = SYN_REPORT },
+		};
+		if (write(led->fd, events, sizeof(events)) < 0 && state->ctx.debug)
+			log_printf("could not set %s: %m\n", led->target);
+		return;
+	}
+	const char *value = lit ? led->on : "0\n";
+	if (pwrite(led->fd, value, strlen(value), 0) < 0 && state->ctx.debug)
+		log_printf("could not set %s: %m\n", led->target);
+}
+
+static void led_step(struct state *state, struct timer *timer) {
+	struct led *led = (struct led *)((char *)timer - offsetof(struct led, timer));
+
+	led_set(state, led, !led->lit);
+	if (--led->toggles <= 0)
+		return;
+
+	struct timespec now;
+	time_gettime(&now);
+	timer_arm(&led->timer, &now, led->lit ? led->on_msecs : led->off_msecs);
+}
+
+static void blink_play(struct state *state, struct blink *blink) {
+	struct led *led = &state->leds[blink->led];
+
+	if (state->ctx.debug > 1)
+		log_printf("blinking %s %d times\n", led->target, blink->count);
+	led->on_msecs = blink->on_msecs;
+	led->off_msecs = blink->off_msecs;
+	/* on, then off, count times */
+	led->toggles = blink->count * 2;
+	led->lit = false;
+	led_step(state, &led->timer);
+}
+
+void led_add(struct state *state, const char *target) {
+	state->leds = xreallocarray(state->leds, state->led_count + 1,
+				    sizeof(*state->leds));
+	struct led *led = &state->leds[state->led_count++];
+	memset(led, 0, sizeof(*led));
+	led->target = target;
+	led->fd = -1;
+	led->code = -1;
+	strcpy(led->on, "1\n");
+
+	const char *colon = strrchr(target, ':');
+	if (colon)
+		led->code = led_code(colon + 1);
+}
+
+void led_add_blink(struct state *state, char *spec) {
+	xassert(state->led_count, "--blink can only be set after --led");
+
+	char *key = strchr(spec, ':');
+	char *pattern = key ? strchr(key + 1, ':') : NULL;
+	xassert(pattern, "--blink expects <trigger>:<key>:<on ms>,<off ms>,<count>, got %s",
+		spec);
+	*key++ = 0;
+	*pattern++ = 0;
+
+	state->blinks = xreallocarray(state->blinks, state->blink_count + 1,
+				      sizeof(*state->blinks));
+	struct blink *blink = &state->blinks[state->blink_count++];
+	memset(blink, 0, sizeof(*blink));
+	blink->led = state->led_count - 1;
+	blink->trigger = feedback_trigger("--blink", spec);
+	blink->code = feedback_key("--blink", key);
+	xassert(sscanf(pattern, "%d,%d,%d", &blink->on_msecs,
+		       &blink->off_msecs, &blink->count) == 3
+		&& blink->on_msecs > 0 && blink->off_msecs >= 0
+		&& blink->count > 0,
+		"--blink: invalid pattern %s", pattern);
+}
+
+static void led_open(struct led *led) {
+	char path[PATH_MAX];
+
+	if (led->code >= 0) {
+		int len = strrchr(led->target, ':') - led->target;
+		xassert(len < PATH_MAX, "path too long: %s", led->target);
+		memcpy(path, led->target, len);
+		path[len] = 0;
+		led->fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		xassert(led->fd >= 0, "Could not open %s for LED: %m", path);
+		return;
+	}
+
+	led->fd = open(led->target, O_WRONLY | O_CLOEXEC);
+	xassert(led->fd >= 0, "Could not open LED %s: %m", led->target);
+
+	/* brightness file: use max_brightness next to it if there is one */
+	const char *slash = strrchr(led->target, '/');
+	int dirlen = slash ? slash - led->target + 1 : 0;
+	if (snprintf(path, sizeof(path), "%.*smax_brightness",
+		     dirlen, led->target) >= (int)sizeof(path))
+		return;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	int n = read_safe(fd, led->on, sizeof(led->on) - 1);
+	close(fd);
+	if (n > 0)
+		led->on[n] = 0;
+	else
+		strcpy(led->on, "1\n");
+}
+
+/* open LEDs and register timers once configuration is complete */
+void led_start(struct state *state) {
+	for (int i = 0; i < state->led_count; i++) {
+		led_open(&state->leds[i]);
+		timer_register(state, &state->leds[i].timer, led_step);
+	}
+}
+
+static void blink_trigger(struct state *state, struct buttond_key *key,
+			  enum feedback_trigger trigger) {
+	for (int i = 0; i < state->blink_count; i++) {
+		struct blink *blink = &state->blinks[i];
+
+		if (blink->code == key->code && blink->trigger == trigger)
+			blink_play(state, blink);
+	}
+}
+
+void led_key_transition(struct state *state, struct buttond_key *key,
+			enum buttond_key_state old_state) {
+	/* debounce keeps the original press */
+	if (old_state == BUTTOND_KEY_RELEASED && key->state == BUTTOND_KEY_PRESSED)
+		blink_trigger(state, key, FEEDBACK_PRESS);
+}
+
+void led_key_stage(struct state *state, struct buttond_key *key) {
+	blink_trigger(state, key, FEEDBACK_THRESHOLD);
+}
+
+void led_action_done(struct state *state, struct buttond_key *key) {
+	blink_trigger(state, key, FEEDBACK_DONE);
+}
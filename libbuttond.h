@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: MIT
+/*
+ * buttond key state machine, usable without the daemon:
+ * feed it evdev events and timestamps, poll/sleep until the next
+ * deadline and get called back whenever an action should run.
+ */
+
+#ifndef LIBBUTTOND_H
+#define LIBBUTTOND_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+#include <linux/input.h>
+
+#define BUTTOND_MAX_GUARDS 4
+
+/* virtual keys (e.g. analog axes handled by the caller) get codes from
+ * KEY_CNT on and are fed as EV_KEY events like any other key */
+#define BUTTOND_MAX_VIRTUAL_KEYS 64
+#define BUTTOND_KEY_CNT (KEY_CNT + BUTTOND_MAX_VIRTUAL_KEYS)
+
+/* conditions checked before running an action */
+struct buttond_guard {
+	enum buttond_guard_type {
+		BUTTOND_GUARD_NONE,
+		/* ctx->conditions[arg] is set (maintained by caller) */
+		BUTTOND_GUARD_CONDITION,
+		/* layer arg is active, resolved from layer_name */
+		BUTTOND_GUARD_LAYER,
+		/* key with code arg is held, configured or not */
+		BUTTOND_GUARD_HELD,
+	} type;
+	/* guard passes if condition is NOT met */
+	bool negate;
+	int arg;
+	const char *layer_name;
+};
+
+struct buttond_action {
+	/* type of action (long/short press) */
+	enum buttond_action_type {
+		BUTTOND_LONG_PRESS,
+		BUTTOND_SHORT_PRESS,
+	} type;
+	/* cutoff time for action */
+	int trigger_time;
+	/* command to run */
+	char const *action;
+	/* long press only, not interpreted by the library either: command
+	 * to run when trigger_time is reached while key is still held, and
+	 * if key is released after that without any action running */
+	const char *stage;
+	const char *cancel;
+	/* whether to stop after action has been processed */
+	bool exit_after;
+	/* for callers running action in background: stop it when key is
+	 * released, and after max_runtime ms if not 0 */
+	bool kill_on_release;
+	int max_runtime;
+	/* layer to switch to after action, resolved from switch_layer_name
+	 * by buttond_finalize (-1 if none) */
+	const char *switch_layer_name;
+	int switch_layer;
+	/* all must pass for action to run, first BUTTOND_GUARD_NONE ends list */
+	struct buttond_guard guards[BUTTOND_MAX_GUARDS];
+	/* if not 0, action does not run again within cooldown ms, and at
+	 * most rate_count times per rate_msecs (bursts up to rate_count) */
+	int cooldown;
+	int rate_count;
+	int rate_msecs;
+	/* kept by the library: last run and next rate limit slot in usecs,
+	 * and how many times the action was suppressed by these limits */
+	int64_t last_run_usecs;
+	int64_t rate_tat_usecs;
+	uint64_t suppressed;
+};
+
+struct buttond_key {
+	/* key code */
+	uint16_t code;
+	const char *name;
+
+	/* whether ts_wakeup below is valid */
+	bool has_wakeup;
+
+	/* key actions */
+	int action_count;
+	struct buttond_action *actions;
+
+	/* when key was pressed - valid for state == BUTTOND_KEY_PRESSED or
+	 * BUTTOND_KEY_DEBOUNCE */
+	struct timeval tv_pressed;
+	/* valid when BUTTOND_KEY_DEBOUNCE */
+	struct timeval tv_released;
+	/* when next to wakeup if has_wakeup is set */
+	struct timespec ts_wakeup;
+	/* trigger_time of last long press stage reached, 0 if none */
+	int stage_time;
+	/* source given to buttond_handle_event for the current press,
+	 * NULL if unknown */
+	const char *source;
+
+	/* state machine:
+	 * - RELEASED/PRESSED state
+	 * - DEBOUNCE: immediately after being released for DEBOUNCE_MSECS
+	 * - HANDLED: long press already handled (ignore until release)
+	 */
+	enum buttond_key_state {
+		BUTTOND_KEY_RELEASED,
+		BUTTOND_KEY_PRESSED,
+		BUTTOND_KEY_DEBOUNCE,
+		BUTTOND_KEY_HANDLED,
+	} state;
+};
+
+/* a layer is a full key/action table, only one is active at a time */
+struct buttond_layer {
+	const char *name;
+	struct buttond_key *keys;
+	int key_count;
+};
+
+struct buttond_ctx;
+
+struct buttond_ops {
+	/* called when an action triggers, duration is how long (ms) the key
+	 * was held. The action string itself is not interpreted by the library */
+	void (*action)(struct buttond_ctx *ctx, struct buttond_key *key,
+		       struct buttond_action *action, int64_t duration);
+	/* called when a held key reaches the trigger_time of one of its
+	 * long press actions, before that action triggers if it is the
+	 * last one. If set, the library wakes up for every long press
+	 * time instead of only the last one */
+	void (*stage)(struct buttond_ctx *ctx, struct buttond_key *key,
+		      struct buttond_action *action, int64_t duration);
+	/* called when a key is released after reaching a stage without any
+	 * action running, action is the last stage reached */
+	void (*cancel)(struct buttond_ctx *ctx, struct buttond_key *key,
+		       struct buttond_action *action, int64_t duration);
+	/* called after key->state or the press time changed,
+	 * e.g. to persist it */
+	void (*transition)(struct buttond_ctx *ctx, struct buttond_key *key,
+			   enum buttond_key_state old_state);
+	/* messages: level 0 are errors, higher levels match ctx->debug.
+	 * If unset, errors go to stderr and enabled debug to stdout */
+	void (*log)(struct buttond_ctx *ctx, int level,
+		    const char *fmt, va_list ap);
+};
+
+struct buttond_ctx {
+	/* keys of the active layer */
+	struct buttond_key *keys;
+	int key_count;
+	/* layers[0] is the "default" layer, active on start */
+	struct buttond_layer *layers;
+	int layer_count;
+	int layer;
+	/* layer buttond_add_action adds to */
+	int config_layer;
+	int debounce_msecs;
+	/* external conditions for BUTTOND_GUARD_CONDITION, kept up to date by caller */
+	const bool *conditions;
+	int condition_count;
+	/* bitmap of all keys currently held, by code */
+	uint8_t held[(BUTTOND_KEY_CNT + 7) / 8];
+	/* events dropped for lack of binding (EV_SYN not included) */
+	uint64_t ignored_events;
+	/* debug level, see -v in buttond */
+	int debug;
+	/* next wakeup last logged at debug level 4, tv_sec -1 for none */
+	struct timespec logged_wakeup;
+	bool wakeup_logged;
+	const struct buttond_ops *ops;
+	/* free for use by caller */
+	void *data;
+};
+
+#define BUTTOND_DEFAULT_DEBOUNCE_MSECS 10
+
+/* setup/teardown */
+void buttond_init(struct buttond_ctx *ctx, const struct buttond_ops *ops,
+		  void *data);
+void buttond_free(struct buttond_ctx *ctx);
+
+/* key names: buttond_key_by_name uppercases name in place, 0 if not found */
+uint16_t buttond_key_by_name(char *name);
+const char *buttond_keyname(uint16_t code);
+/* register a virtual key usable with both functions above, name must
+ * stay valid and is uppercased in place.
+ * Returns its code, 0 if name is taken or all codes are used */
+uint16_t buttond_add_virtual_key(char *name);
+
+/* configuration: add actions, then call buttond_finalize once.
+ * buttond_add_layer selects (creating if required) the layer following
+ * actions are added to, "default" until called.
+ * buttond_add_action returns NULL on allocation failure;
+ * buttond_finalize returns -EINVAL if configuration is inconsistent */
+int buttond_add_layer(struct buttond_ctx *ctx, const char *name);
+struct buttond_action *buttond_add_action(struct buttond_ctx *ctx,
+					  uint16_t code,
+					  enum buttond_action_type type,
+					  int trigger_time);
+int buttond_finalize(struct buttond_ctx *ctx);
+/* returns -ENOSPC if action already has BUTTOND_MAX_GUARDS guards */
+int buttond_add_guard(struct buttond_action *action, enum buttond_guard_type type,
+		      bool negate, int arg, const char *layer_name);
+/* look up key in active layer */
+struct buttond_key *buttond_find_key(struct buttond_ctx *ctx, uint16_t code);
+
+/* layers: index from name (-1 if not found) and switch active layer.
+ * Keys held in the previous layer are reset */
+int buttond_find_layer(struct buttond_ctx *ctx, const char *name);
+void buttond_set_layer(struct buttond_ctx *ctx, int layer);
+
+static inline bool buttond_key_held(struct buttond_ctx *ctx, uint16_t code) {
+	return code < BUTTOND_KEY_CNT && (ctx->held[code / 8] & (1 << (code % 8)));
+}
+
+/* mark key as pressed at time now, e.g. if it was found down on open */
+void buttond_arm_key(struct buttond_ctx *ctx, struct buttond_key *key,
+		     const struct timespec *now);
+/* same with the press time kept from before a restart; if handled its
+ * long press already ran and only the release is left */
+void buttond_resume_key(struct buttond_ctx *ctx, struct buttond_key *key,
+			const struct timespec *pressed, bool handled);
+
+/* runtime: event timestamps must be CLOCK_MONOTONIC (EVIOCSCLOCKID),
+ * and now also comes from CLOCK_MONOTONIC.
+ * source is only used for debug messages and can be NULL */
+void buttond_handle_event(struct buttond_ctx *ctx, struct input_event *event,
+			  const char *source);
+/* time until next deadline in ms, -1 if none */
+int buttond_next_timeout(struct buttond_ctx *ctx, const struct timespec *now);
+void buttond_handle_timeouts(struct buttond_ctx *ctx,
+			     const struct timespec *now);
+
+#endif
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Debug output (-v) without blocking the event loop: messages are
+ * formatted into a preallocated ring and written to stdout from the
+ * main loop when poll says it is writable, at most PIPE_BUF bytes at a
+ * time so a slow reader (pipe to a logger) can never block us.
+ * Messages that do not fit are dropped and counted, the count is
+ * logged once there is room again.
+ *
+ * --log-format selects plain text (default), key=value (logfmt) or
+ * JSON lines, the latter two with timestamp and level fields for
+ * journald/syslog ingestion.
+ * Errors still go synchronously to stderr.
+ */
+
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "buttond.h"
+
+#define LOG_RING_SIZE 65536
+/* longest message, longer ones are truncated */
+#define LOG_MESSAGE_MAX 512
+
+enum log_format {
+	LOG_TEXT,
+	LOG_KV,
+	LOG_JSON,
+};
+
+static enum log_format log_format;
+static char ring[LOG_RING_SIZE];
+/* total bytes ever added/written, ring index is modulo size */
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static uint64_t dropped;
+static uint64_t dropped_total;
+
+void log_set_format(const char *name) {
+	if (strcmp(name, "text") == 0)
+		log_format = LOG_TEXT;
+	else if (strcmp(name, "kv") == 0)
+		log_format = LOG_KV;
+	else if (strcmp(name, "json") == 0)
+		log_format = LOG_JSON;
+	else
+		xassert(false, "--log-format must be text, kv or json, got %s", name);
+}
+
+static void ring_add(const char *data, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		ring[(ring_head + i) % LOG_RING_SIZE] = data[i];
+	ring_head += len;
+}
+
+/* quote message for kv/json: both escape backslash, quote and control
+ * characters the same way for what we log */
+static size_t escape(char *out, size_t size, const char *msg) {
+	size_t n = 0;
+
+	for (; *msg && n + 6 < size; msg++) {
+		unsigned char c = *msg;
+		if (c == '"' || c == '\\') {
+			out[n++] = '\\';
+			out[n++] = c;
+		} else if (c == '\n') {
+			out[n++] = '\\';
+			out[n++] = 'n';
+		} else if (c < 0x20) {
+			n += snprintf(out + n, size - n, "\\u%04x", c);
+		} else {
+			out[n++] = c;
+		}
+	}
+	out[n] = 0;
+	return n;
+}
+
+static void log_add(int level, const char *msg) {
+	char line[2 * LOG_MESSAGE_MAX + 128];
+	char escaped[2 * LOG_MESSAGE_MAX];
+	int len;
+
+	if (log_format == LOG_TEXT) {
+		len = snprintf(line, sizeof(line), "%s\n", msg);
+	} else {
+		struct timespec now;
+		time_gettime(&now);
+		escape(escaped, sizeof(escaped), msg);
+		len = snprintf(line, sizeof(line),
+			       log_format == LOG_KV
+			       ? "ts=%lld.%03ld level=%d msg=\"%s\"\n"
+			       : "{\"ts\":%lld.%03ld,\"level\":%d,\"msg\":\"%s\"}\n",
+			       (long long)now.tv_sec, now.tv_nsec / NSECS_IN_MSEC,
+			       level, escaped);
+	}
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(line))
+		len = sizeof(line) - 1;
+	if (ring_head - ring_tail + len > LOG_RING_SIZE) {
+		dropped++;
+		dropped_total++;
+		return;
+	}
+	ring_add(line, len);
+}
+
+void log_vprintf(int level, const char *fmt, va_list ap) {
+	char msg[LOG_MESSAGE_MAX];
+
+	if (dropped) {
+		char notice[64];
+		uint64_t count = dropped;
+
+		snprintf(notice, sizeof(notice), "%"PRIu64" log messages dropped", count);
+		dropped = 0;
+		log_add(0, notice);
+		/* still no room: keep counting */
+		if (dropped) {
+			dropped = count + 1;
+			return;
+		}
+	}
+	int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	/* one record per message: trailing newline is ours to add */
+	if (len > 0 && (size_t)len < sizeof(msg) && msg[len - 1] == '\n')
+		msg[len - 1] = 0;
+	log_add(level, msg);
+}
+
+void log_printf(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vprintf(1, fmt, ap);
+	va_end(ap);
+}
+
+uint64_t log_dropped(void) {
+	return dropped_total;
+}
+
+/* set POLLOUT on stdout slot if there is anything to write */
+void log_poll_prepare(struct state *state) {
+	struct pollfd *pollfd = pollfd_slot(state, POLLFD_LOG);
+
+	pollfd->fd = ring_head != ring_tail ? STDOUT_FILENO : -1;
+	pollfd->events = POLLOUT;
+	pollfd->revents = 0;
+}
+
+static bool log_write(size_t max) {
+	size_t offset = ring_tail % LOG_RING_SIZE;
+	size_t len = ring_head - ring_tail;
+
+	/* up to the end of the ring, rest on next call */
+	if (len > LOG_RING_SIZE - offset)
+		len = LOG_RING_SIZE - offset;
+	if (len > max)
+		len = max;
+	ssize_t n = write(STDOUT_FILENO, ring + offset, len);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0) {
+		/* nobody is reading: give up on what we have */
+		ring_tail = ring_head;
+		return false;
+	}
+	ring_tail += n;
+	return true;
+}
+
+void log_handle(struct state *state) {
+	if (!pollfd_slot(state, POLLFD_LOG)->revents)
+		return;
+	/* a writable pipe takes at least PIPE_BUF bytes without blocking */
+	log_write(PIPE_BUF);
+}
+
+/* blocking, before exit or exec */
+void log_flush(void) {
+	while (ring_head != ring_tail && log_write(LOG_RING_SIZE))
+		;
+}
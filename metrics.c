@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Prometheus metrics (--metrics-file <file>): counters are rewritten to
+ * <file> every --metrics-interval from a daemon timer, for
+ * node_exporter's textfile collector. The file is written next to its
+ * final name and renamed so a scrape never sees a partial file.
+ *
+ * Counters are plain integers bumped from the event loop, nothing is
+ * formatted until the file is written.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+
+#include "buttond.h"
+
+#define METRICS_DEFAULT_INTERVAL_MSECS 15000
+
+/* histogram upper bounds, in usecs, +Inf is implicit */
+static const int64_t bucket_usecs[] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+};
+#define BUCKET_COUNT (sizeof(bucket_usecs) / sizeof(bucket_usecs[0]))
+
+struct histogram {
+	uint64_t buckets[BUCKET_COUNT];
+	uint64_t count;
+	uint64_t sum_usecs;
+};
+
+struct action_counter {
+	uint16_t code;
+	const char *name;
+	const char *type;
+	uint64_t count;
+	struct histogram time;
+};
+
+static const char *metrics_path;
+static int metrics_interval = METRICS_DEFAULT_INTERVAL_MSECS;
+static struct timer metrics_timer;
+static struct histogram event_lag;
+static struct action_counter *action_counters;
+static int action_counter_count;
+
+void metrics_set_file(const char *path) {
+	metrics_path = path;
+}
+
+void metrics_set_interval(const char *interval) {
+	metrics_interval = strtoint(interval);
+	xassert(errno == 0 && metrics_interval > 0,
+		"Invalid metrics interval %s", interval);
+}
+
+static void histogram_observe(struct histogram *histogram, int64_t usecs) {
+	size_t i;
+
+	for (i = 0; i < BUCKET_COUNT && usecs > bucket_usecs[i]; i++)
+		;
+	/* buckets are cumulated when written */
+	if (i < BUCKET_COUNT)
+		histogram->buckets[i]++;
+	histogram->count++;
+	histogram->sum_usecs += usecs;
+}
+
+void metrics_event_lag(int64_t usecs) {
+	if (metrics_path)
+		histogram_observe(&event_lag, usecs);
+}
+
+/* action of given type ran for key, start is when it was started */
+void metrics_action(struct buttond_key *key, const char *type,
+		    const struct timespec *start) {
+	struct action_counter *counter = NULL;
+	struct timespec now;
+
+	if (!metrics_path)
+		return;
+	for (int i = 0; i < action_counter_count; i++) {
+		if (action_counters[i].code == key->code
+		    && strcmp(action_counters[i].type, type) == 0)
+			counter = &action_counters[i];
+	}
+	if (!counter) {
+		action_counters = xreallocarray(action_counters,
+						action_counter_count + 1,
+						sizeof(*action_counters));
+		counter = &action_counters[action_counter_count++];
+		memset(counter, 0, sizeof(*counter));
+		counter->code = key->code;
+		counter->name = key->name;
+		counter->type = type;
+	}
+	counter->count++;
+	time_gettime(&now);
+	histogram_observe(&counter->time,
+			  (now.tv_sec - start->tv_sec) * USECS_IN_SEC
+			  + (now.tv_nsec - start->tv_nsec) / NSECS_IN_USEC);
+}
+
+/* label values are paths and key names: escape the few special chars */
+static void write_label(FILE *out, const char *value) {
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', out);
+		if (*value == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*value, out);
+	}
+}
+
+static void write_header(FILE *out, const char *name, const char *type,
+			 const char *help) {
+	fprintf(out, "# HELP buttond_%s %s\n# TYPE buttond_%s %s\n",
+		name, help, name, type);
+}
+
+static void write_histogram(FILE *out, const char *name, const char *labels,
+			    struct histogram *histogram) {
+	uint64_t cumulated = 0;
+
+	for (size_t i = 0; i < BUCKET_COUNT; i++) {
+		cumulated += histogram->buckets[i];
+		fprintf(out, "buttond_%s_bucket{%s%sle=\"%g\"} %"PRIu64"\n",
+			name, labels, labels[0] ? "," : "",
+			bucket_usecs[i] / (double)USECS_IN_SEC, cumulated);
+	}
+	fprintf(out, "buttond_%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n",
+		name, labels, labels[0] ? "," : "", histogram->count);
+	fprintf(out, "buttond_%s_sum%s%s%s %g\n", name,
+		labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		histogram->sum_usecs / (double)USECS_IN_SEC);
+	fprintf(out, "buttond_%s_count%s%s%s %"PRIu64"\n", name,
+		labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+		histogram->count);
+}
+
+static void write_reader_metrics(FILE *out) {
+	struct reader_stats stats;
+
+	if (!readers_stats(0, &stats))
+		return;
+	write_header(out, "reader_events_total", "counter",
+		     "Events read per --reader-threads thread");
+	for (int r = 0; readers_stats(r, &stats); r++)
+		fprintf(out, "buttond_reader_events_total{reader=\"%d\"} %"PRIu64"\n",
+			r, stats.events);
+	write_header(out, "reader_stalls_total", "counter",
+		     "Times a reader thread waited for the event loop to catch up");
+	for (int r = 0; readers_stats(r, &stats); r++)
+		fprintf(out, "buttond_reader_stalls_total{reader=\"%d\"} %"PRIu64"\n",
+			r, stats.stalls);
+}
+
+static void write_metrics(struct state *state, FILE *out) {
+	write_header(out, "events_total", "counter", "Events read per input");
+	for (int i = 0; i < state->input_count; i++) {
+		fputs("buttond_events_total{input=\"", out);
+		write_label(out, state->input_files[i].filename);
+		fprintf(out, "\"} %"PRIu64"\n", state->input_files[i].lag.events);
+	}
+	write_header(out, "late_events_total", "counter",
+		     "Events read later than --lag-warn per input");
+	for (int i = 0; i < state->input_count; i++) {
+		fputs("buttond_late_events_total{input=\"", out);
+		write_label(out, state->input_files[i].filename);
+		fprintf(out, "\"} %"PRIu64"\n", state->input_files[i].lag.late);
+	}
+	write_header(out, "reopens_total", "counter",
+		     "Times an input was reopened after an error or removal");
+	for (int i = 0; i < state->input_count; i++) {
+		fputs("buttond_reopens_total{input=\"", out);
+		write_label(out, state->input_files[i].filename);
+		fprintf(out, "\"} %"PRIu64"\n", state->input_files[i].reopens);
+	}
+	write_header(out, "ignored_events_total", "counter",
+		     "Events without any key binding");
+	fprintf(out, "buttond_ignored_events_total %"PRIu64"\n",
+		state->ctx.ignored_events);
+	write_header(out, "log_dropped_total", "counter",
+		     "Debug messages dropped because the log buffer was full");
+	fprintf(out, "buttond_log_dropped_total %"PRIu64"\n", log_dropped());
+	write_header(out, "wakeups_total", "counter", "Event loop wakeups");
+	fprintf(out, "buttond_wakeups_total %"PRIu64"\n", state->wakeups);
+	write_reader_metrics(out);
+	write_header(out, "event_lag_seconds", "histogram",
+		     "Delay between kernel event timestamps and their read");
+	write_histogram(out, "event_lag_seconds", "", &event_lag);
+
+	write_header(out, "actions_total", "counter",
+		     "Actions run per key and type");
+	for (int i = 0; i < action_counter_count; i++) {
+		fputs("buttond_actions_total{key=\"", out);
+		write_label(out, action_counters[i].name);
+		fprintf(out, "\",type=\"%s\"} %"PRIu64"\n",
+			action_counters[i].type, action_counters[i].count);
+	}
+	write_header(out, "actions_suppressed_total", "counter",
+		     "Actions not run because of --cooldown or --rate-limit");
+	for (int l = 0; l < state->ctx.layer_count; l++) {
+		struct buttond_layer *layer = &state->ctx.layers[l];
+
+		for (int k = 0; k < layer->key_count; k++) {
+			struct buttond_key *key = &layer->keys[k];
+
+			for (int a = 0; a < key->action_count; a++) {
+				struct buttond_action *action = &key->actions[a];
+
+				if (!action->cooldown && !action->rate_count)
+					continue;
+				fputs("buttond_actions_suppressed_total{key=\"", out);
+				write_label(out, key->name);
+				fprintf(out, "\",layer=\"");
+				write_label(out, layer->name);
+				fprintf(out, "\",type=\"%s\",time_ms=\"%d\"} %"PRIu64"\n",
+					action->type == BUTTOND_LONG_PRESS ? "long" : "short",
+					action->trigger_time, action->suppressed);
+			}
+		}
+	}
+	write_header(out, "action_seconds", "histogram",
+		     "Time the event loop spent starting or running actions");
+	for (int i = 0; i < action_counter_count; i++) {
+		char *labels = NULL;
+		size_t size = 0;
+		FILE *label_out = open_memstream(&labels, &size);
+		if (!label_out)
+			continue;
+		fputs("key=\"", label_out);
+		write_label(label_out, action_counters[i].name);
+		fprintf(label_out, "\",type=\"%s\"", action_counters[i].type);
+		fclose(label_out);
+		write_histogram(out, "action_seconds", labels,
+				&action_counters[i].time);
+		free(labels);
+	}
+}
+
+static void metrics_write(struct state *state, struct timer *timer) {
+	char tmp[PATH_MAX];
+	struct timespec now;
+
+	time_gettime(&now);
+	timer_arm(timer, &now, metrics_interval);
+
+	xassert(snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path) < (int)sizeof(tmp),
+		"path too long: %s", metrics_path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create %s: %m\n", tmp);
+		return;
+	}
+	FILE *out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		return;
+	}
+	write_metrics(state, out);
+	bool ok = !ferror(out);
+	if (fclose(out) != 0 || !ok || rename(tmp, metrics_path) != 0) {
+		fprintf(stderr, "Could not write %s: %m\n", metrics_path);
+		unlink(tmp);
+	}
+}
+
+void metrics_start(struct state *state, const struct timespec *now) {
+	if (!metrics_path)
+		return;
+	timer_register(state, &metrics_timer, metrics_write);
+	/* first write right away */
+	timer_arm(&metrics_timer, now, 0);
+}
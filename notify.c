@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Readiness notification, once inputs are open and keys already held
+ * were checked, so whatever depends on buttond does not have to sleep:
+ *  - --ready-fd <fd>: write a newline to <fd> and close it, as s6
+ *    notification-fd
+ *  - NOTIFY_SOCKET: send READY=1 as sd_notify(3) does (datagram to a
+ *    unix socket, '@' for abstract namespace)
+ * Neither is repeated after a hot upgrade: the fd is closed by then,
+ * and NOTIFY_SOCKET is removed from our environment (actions do not
+ * get it either).
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "buttond.h"
+
+#define NOTIFY_SOCKET_ENV "NOTIFY_SOCKET"
+
+static int ready_fd = -1;
+static char *notify_socket;
+
+void notify_set_fd(const char *fd) {
+	/* already notified and closed, the number may be reused since */
+	if (upgrade_pending())
+		return;
+	ready_fd = strtoint(fd);
+	xassert(errno == 0 && ready_fd > STDERR_FILENO,
+		"Invalid ready fd %s", fd);
+	int flags = fcntl(ready_fd, F_GETFD);
+	xassert(flags != -1, "Invalid ready fd %s: %m", fd);
+	/* actions spawned before we are ready must not hold it open */
+	xassert(fcntl(ready_fd, F_SETFD, flags | FD_CLOEXEC) == 0,
+		"Could not set close-on-exec on ready fd %s: %m", fd);
+}
+
+/* must be called before spawn_init copies our environment */
+void notify_init(void) {
+	const char *env = getenv(NOTIFY_SOCKET_ENV);
+
+	if (!env)
+		return;
+	notify_socket = xstrdup(env);
+	unsetenv(NOTIFY_SOCKET_ENV);
+}
+
+static void notify_send(const char *path, const char *message) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t len = strlen(path);
+
+	if ((path[0] != '/' && path[0] != '@') || len >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Unsupported %s %s\n", NOTIFY_SOCKET_ENV, path);
+		return;
+	}
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@')
+		addr.sun_path[0] = 0;
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0
+	    || sendto(fd, message, strlen(message), MSG_NOSIGNAL,
+		      (struct sockaddr *)&addr,
+		      offsetof(struct sockaddr_un, sun_path) + len) < 0)
+		fprintf(stderr, "Could not notify %s: %m\n", path);
+	if (fd >= 0)
+		close(fd);
+}
+
+/* upgraded: we replaced a running buttond that already notified */
+void notify_ready(struct state *state, bool upgraded) {
+	if (upgraded)
+		return;
+	if (ready_fd >= 0) {
+		if (write(ready_fd, "\n", 1) < 0)
+			fprintf(stderr, "Could not notify ready fd %d: %m\n", ready_fd);
+		close(ready_fd);
+		ready_fd = -1;
+	}
+	if (notify_socket) {
+		notify_send(notify_socket, "READY=1");
+		free(notify_socket);
+		notify_socket = NULL;
+	}
+	if (state->ctx.debug)
+		log_printf("ready\n");
+}
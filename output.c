@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Action output capture (--capture-output <KiB>): actions get a pipe
+ * as stdout and stderr instead of ours, so their output is neither
+ * mixed with -v messages nor able to block us on a full pipe. It is
+ * kept in a ring of the last <KiB> per command, along with the exit
+ * status and runtime of its last run, shown by the `output` control
+ * command and dumped on stderr when the command fails.
+ *
+ * Tracked actions are read from the event loop (POLLFD_OUTPUT slots),
+ * others until they exit as we wait for them anyway.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "buttond.h"
+
+#define OUTPUT_KIB_MAX 1024
+
+struct output {
+	const char *command;
+	char *ring;
+	/* bytes ever written, ring index is modulo size */
+	uint64_t written;
+	uint64_t runs;
+	/* wait status of last run, -1 before the first one ended */
+	int status;
+	int64_t runtime_msecs;
+};
+
+static size_t output_size;
+static struct output *outputs;
+static int output_count;
+
+void output_set_size(const char *kib) {
+	int value = strtoint(kib);
+
+	xassert(errno == 0 && value >= 0 && value <= OUTPUT_KIB_MAX,
+		"Invalid capture size %s KiB (max %d)", kib, OUTPUT_KIB_MAX);
+	output_size = value * 1024;
+}
+
+/* output record for command, NULL if capture is disabled */
+struct output *output_get(const char *command) {
+	if (!output_size || !command)
+		return NULL;
+	for (int i = 0; i < output_count; i++) {
+		if (outputs[i].command == command)
+			return &outputs[i];
+	}
+	outputs = xreallocarray(outputs, output_count + 1, sizeof(*outputs));
+	struct output *output = &outputs[output_count++];
+	memset(output, 0, sizeof(*output));
+	output->command = command;
+	output->status = -1;
+	output->ring = xcalloc(1, output_size);
+	return output;
+}
+
+static void output_append(struct output *output, const char *data, size_t len) {
+	/* only the end fits */
+	if (len > output_size) {
+		output->written += len - output_size;
+		data += len - output_size;
+		len = output_size;
+	}
+	size_t pos = output->written % output_size;
+	size_t first = len < output_size - pos ? len : output_size - pos;
+	memcpy(output->ring + pos, data, first);
+	memcpy(output->ring, data + first, len - first);
+	output->written += len;
+}
+
+/* read what is available, returns false on EOF or error (fd must be
+ * closed). output can be NULL to discard */
+bool output_read(struct output *output, int fd) {
+	char buf[4096];
+
+	while (1) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return true;
+		if (n <= 0)
+			return false;
+		if (output)
+			output_append(output, buf, n);
+	}
+}
+
+/* read output until pid exits rather than until EOF, a background
+ * child of the action could keep the pipe open. Closes fd */
+void output_wait(struct output *output, int fd, pid_t pid) {
+	struct pollfd pollfds[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = pidfd_open(pid), .events = POLLIN },
+	};
+
+	/* without pidfd: EOF is the best we can do */
+	while (1) {
+		int n = poll(pollfds, pollfds[1].fd >= 0 ? 2 : 1, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		if (pollfds[0].revents && !output_read(output, fd))
+			break;
+		if (pollfds[1].fd >= 0 && pollfds[1].revents) {
+			output_read(output, fd);
+			break;
+		}
+	}
+	if (pollfds[1].fd >= 0)
+		close(pollfds[1].fd);
+	close(fd);
+}
+
+static void output_write(struct output *output, FILE *out) {
+	uint64_t kept = output->written < output_size ? output->written : output_size;
+	size_t pos = (output->written - kept) % output_size;
+	size_t first = kept < output_size - pos ? kept : output_size - pos;
+
+	fwrite(output->ring + pos, 1, first, out);
+	fwrite(output->ring, 1, kept - first, out);
+	if (kept && output->ring[(output->written - 1) % output_size] != '\n')
+		fputc('\n', out);
+}
+
+/* command exited with wait status, dumps its output if it failed */
+void output_done(struct output *output, int status,
+		 const struct timespec *start) {
+	struct timespec now;
+
+	if (!output)
+		return;
+	time_gettime(&now);
+	output->runs++;
+	output->status = status;
+	output->runtime_msecs = ((now.tv_sec - start->tv_sec) * USECS_IN_SEC
+		+ (now.tv_nsec - start->tv_nsec) / NSECS_IN_USEC) / USECS_IN_MSEC;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return;
+
+	/* -v messages first */
+	log_flush();
+	if (WIFSIGNALED(status))
+		fprintf(stderr, "%s killed by signal %d after %"PRId64"ms, output:\n",
+			output->command, WTERMSIG(status), output->runtime_msecs);
+	else
+		fprintf(stderr, "%s exited with %d after %"PRId64"ms, output:\n",
+			output->command, WEXITSTATUS(status), output->runtime_msecs);
+	output_write(output, stderr);
+}
+
+static void status_string(int status, char *buf, size_t size) {
+	if (status < 0)
+		snprintf(buf, size, "-");
+	else if (WIFSIGNALED(status))
+		snprintf(buf, size, "signal:%d", WTERMSIG(status));
+	else
+		snprintf(buf, size, "%d", WEXITSTATUS(status));
+}
+
+/* list commands, or show output of command index if idx >= 0 */
+void output_report(FILE *out, int idx) {
+	char status[32];
+
+	if (idx >= output_count) {
+		fprintf(out, "error: no output %d\n", idx);
+		return;
+	}
+	if (idx >= 0) {
+		output_write(&outputs[idx], out);
+		return;
+	}
+	for (int i = 0; i < output_count; i++) {
+		struct output *output = &outputs[i];
+
+		status_string(output->status, status, sizeof(status));
+		fprintf(out, "%d runs %"PRIu64" status %s runtime_ms %"PRId64" bytes %"PRIu64" command %s\n",
+			i, output->runs, status, output->runtime_msecs,
+			output->written, output->command);
+	}
+}
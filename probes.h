@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: MIT
+/*
+ * USDT probes for bpftrace/perf (provider "buttond"), e.g.
+ *   bpftrace -e 'usdt:./buttond:buttond:action_done { @[arg0] = hist(nsecs - arg2); }'
+ * Probes are a single nop when nobody is attached, and compiled out
+ * when <sys/sdt.h> (systemtap-sdt-dev) is not available.
+ *
+ *   event_read(input, type, code, value)
+ *   key_state(code, old state, new state)
+ *   key_arm(code, wakeup sec, wakeup nsec): has_wakeup set or cleared (sec 0)
+ *   action_start(code, action type)
+ *   action_done(code, action type, start time): start is CLOCK_MONOTONIC
+ *     in nsecs like bpftrace's nsecs, so the time spent in the loop is
+ *     not computed unless traced
+ */
+
+#ifndef BUTTOND_PROBES_H
+#define BUTTOND_PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define BUTTOND_HAVE_SDT
+#endif
+#endif
+
+#ifdef BUTTOND_HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(buttond, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(buttond, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(buttond, name, a, b, c, d)
+#else
+/* arguments are plain reads: keep them "used" without any cost */
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif
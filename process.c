@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Tracked actions (--kill-on-release, --max-runtime): instead of
+ * waiting for the command, the shell is left running and
+ * followed through a pidfd in the poll loop, so it can be signalled
+ * without racing with pid reuse.
+ * Stopping sends SIGTERM, then SIGKILL if still running after
+ * PROCESS_KILL_GRACE_MSECS, to the whole process group spawn() put the
+ * shell in so pipelines and background children go with it.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "buttond.h"
+
+#define PROCESS_KILL_GRACE_MSECS 1000
+
+struct process {
+	/* must stay first, see process_timeout */
+	struct timer timer;
+	pid_t pid;
+	/* key that must stay held, NULL if not killed on release */
+	struct buttond_key *key;
+	const char *command;
+	/* --capture-output record, NULL if not captured */
+	struct output *output;
+	struct timespec start;
+	bool term_sent;
+};
+
+static struct process processes[PROCESS_MAX];
+
+static int pidfd_send_signal(int pidfd, int sig) {
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+static struct pollfd *process_pollfd(struct state *state, int i) {
+	return pollfd_slot(state, POLLFD_PROCESS + i);
+}
+
+static struct pollfd *output_pollfd(struct state *state, int i) {
+	return pollfd_slot(state, POLLFD_OUTPUT + i);
+}
+
+static void output_close(struct state *state, int i) {
+	struct pollfd *pollfd = output_pollfd(state, i);
+
+	if (pollfd->fd < 0)
+		return;
+	close(pollfd->fd);
+	pollfd->fd = -1;
+	pollfd->events = 0;
+}
+
+static void process_signal(struct state *state, int i, int sig) {
+	struct process *process = &processes[i];
+
+	if (state->ctx.debug)
+		log_printf("sending %s to %s (%d)\n", sig == SIGKILL ? "SIGKILL" : "SIGTERM",
+			   process->command ? process->command : "action",
+			   process->pid);
+	/* the leader is not reaped before its pidfd polls: while it is
+	 * still ours so is its group */
+	if (pidfd_send_signal(process_pollfd(state, i)->fd, 0) < 0) {
+		if (errno != ESRCH)
+			fprintf(stderr, "Could not signal %d: %m\n", process->pid);
+		return;
+	}
+	if (kill(-process->pid, sig) < 0
+	    && pidfd_send_signal(process_pollfd(state, i)->fd, sig) < 0
+	    && errno != ESRCH)
+		fprintf(stderr, "Could not signal %d: %m\n", process->pid);
+}
+
+static void process_stop(struct state *state, int i) {
+	struct process *process = &processes[i];
+	struct timespec now;
+
+	if (process->term_sent)
+		return;
+	process->term_sent = true;
+	process_signal(state, i, SIGTERM);
+	time_gettime(&now);
+	timer_arm(&process->timer, &now, PROCESS_KILL_GRACE_MSECS);
+}
+
+static void process_timeout(struct state *state, struct timer *timer) {
+	/* timer is the first field */
+	int i = (struct process *)timer - processes;
+
+	if (processes[i].term_sent)
+		process_signal(state, i, SIGKILL);
+	else
+		process_stop(state, i);
+}
+
+void process_init(struct state *state) {
+	for (int i = 0; i < PROCESS_MAX; i++)
+		timer_register(state, &processes[i].timer, process_timeout);
+}
+
+/* run command in background and track it, returns false if it could
+ * not be started */
+bool process_spawn(struct state *state, struct buttond_key *key,
+		   struct buttond_action *action) {
+	int i;
+
+	for (i = 0; i < PROCESS_MAX; i++) {
+		if (process_pollfd(state, i)->fd < 0)
+			break;
+	}
+	if (i == PROCESS_MAX) {
+		fprintf(stderr, "Too many running actions, not running %s\n",
+			action->action);
+		return false;
+	}
+
+	struct process *process = &processes[i];
+	int output_fd = -1;
+	process->output = output_get(action->action);
+	time_gettime(&process->start);
+	pid_t pid = spawn(action->action, process->output ? &output_fd : NULL);
+	if (pid < 0)
+		return false;
+
+	/* child cannot be reaped before we wait for it: no race here */
+	int pidfd = pidfd_open(pid);
+	if (pidfd < 0) {
+		int status;
+		fprintf(stderr, "pidfd_open failed, waiting for %s: %m\n",
+			action->action);
+		if (output_fd >= 0)
+			output_wait(process->output, output_fd, pid);
+		if (waitpid(pid, &status, 0) > 0)
+			output_done(process->output, status, &process->start);
+		return true;
+	}
+	fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+	process->pid = pid;
+	process->command = action->action;
+	process->term_sent = false;
+	/* only meaningful if the action triggered while held */
+	process->key = action->kill_on_release && key->state == BUTTOND_KEY_HANDLED
+		? key : NULL;
+	timer_disarm(&process->timer);
+	if (action->max_runtime) {
+		struct timespec now;
+		time_gettime(&now);
+		timer_arm(&process->timer, &now, action->max_runtime);
+	}
+	process_pollfd(state, i)->fd = pidfd;
+	process_pollfd(state, i)->events = POLLIN;
+	output_pollfd(state, i)->fd = output_fd;
+	output_pollfd(state, i)->events = output_fd >= 0 ? POLLIN : 0;
+	if (state->ctx.debug)
+		log_printf("started %s (%d)\n", action->action, pid);
+	return true;
+}
+
+void process_key_transition(struct state *state, struct buttond_key *key) {
+	if (key->state != BUTTOND_KEY_RELEASED)
+		return;
+	for (int i = 0; i < PROCESS_MAX; i++) {
+		if (process_pollfd(state, i)->fd >= 0 && processes[i].key == key)
+			process_stop(state, i);
+	}
+}
+
+void process_handle(struct state *state) {
+	for (int i = 0; i < PROCESS_MAX; i++) {
+		struct pollfd *pollfd = process_pollfd(state, i);
+		struct process *process = &processes[i];
+		int status;
+
+		if (output_pollfd(state, i)->revents
+		    && !output_read(process->output, output_pollfd(state, i)->fd))
+			output_close(state, i);
+		if (!pollfd->revents)
+			continue;
+		pid_t pid = waitpid(process->pid, &status, WNOHANG);
+		if (pid == 0)
+			continue;
+		/* whatever it wrote before exiting */
+		if (output_pollfd(state, i)->fd >= 0)
+			output_read(process->output, output_pollfd(state, i)->fd);
+		output_close(state, i);
+		if (pid > 0)
+			output_done(process->output, status, &process->start);
+		if (pid > 0 && state->ctx.debug) {
+			if (WIFSIGNALED(status))
+				log_printf("%s (%d) killed by signal %d\n",
+					   process->command ? process->command : "action",
+					   process->pid, WTERMSIG(status));
+			else
+				log_printf("%s (%d) exited with %d\n",
+					   process->command ? process->command : "action",
+					   process->pid, WEXITSTATUS(status));
+		}
+		close(pollfd->fd);
+		pollfd->fd = -1;
+		pollfd->events = 0;
+		process->key = NULL;
+		timer_disarm(&process->timer);
+	}
+}
+
+void process_save(struct state *state, int fd) {
+	for (int i = 0; i < PROCESS_MAX; i++) {
+		struct process *process = &processes[i];
+		int layer = -1, code = 0;
+
+		if (process_pollfd(state, i)->fd < 0)
+			continue;
+		for (int l = 0; process->key && l < state->ctx.layer_count; l++) {
+			struct buttond_layer *cur = &state->ctx.layers[l];
+			if (process->key >= cur->keys
+			    && process->key < cur->keys + cur->key_count) {
+				layer = l;
+				code = process->key->code;
+			}
+		}
+		dprintf(fd, "process %d %d %d %d %d %d %lld %ld %d\n",
+			process_pollfd(state, i)->fd, process->pid, layer, code,
+			process->term_sent, process->timer.armed,
+			(long long)process->timer.deadline.tv_sec,
+			(long)process->timer.deadline.tv_nsec,
+			output_pollfd(state, i)->fd);
+	}
+}
+
+void process_restore(struct state *state, const char *line) {
+	int pidfd, pid, layer, code, term_sent, armed, output_fd, i;
+	long long sec;
+	long nsec;
+
+	if (sscanf(line, "process %d %d %d %d %d %d %lld %ld %d", &pidfd, &pid,
+		   &layer, &code, &term_sent, &armed, &sec, &nsec,
+		   &output_fd) != 9)
+		return;
+	for (i = 0; i < PROCESS_MAX; i++) {
+		if (process_pollfd(state, i)->fd < 0)
+			break;
+	}
+	fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+	if (output_fd >= 0)
+		fcntl(output_fd, F_SETFD, FD_CLOEXEC);
+	if (i == PROCESS_MAX) {
+		close(pidfd);
+		if (output_fd >= 0)
+			close(output_fd);
+		return;
+	}
+
+	struct process *process = &processes[i];
+	process->pid = pid;
+	process->command = NULL;
+	/* captured output so far stayed in the previous binary, the rest
+	 * is drained and dropped */
+	process->output = NULL;
+	process->term_sent = term_sent;
+	process->key = NULL;
+	if (layer >= 0 && layer < state->ctx.layer_count) {
+		struct buttond_layer *cur = &state->ctx.layers[layer];
+		for (int k = 0; k < cur->key_count; k++) {
+			if (cur->keys[k].code == code)
+				process->key = &cur->keys[k];
+		}
+	}
+	process->timer.armed = armed;
+	process->timer.deadline.tv_sec = sec;
+	process->timer.deadline.tv_nsec = nsec;
+	process_pollfd(state, i)->fd = pidfd;
+	process_pollfd(state, i)->events = POLLIN;
+	output_pollfd(state, i)->fd = output_fd;
+	output_pollfd(state, i)->events = output_fd >= 0 ? POLLIN : 0;
+}
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Reader threads (--reader-threads <n>): with hundreds of inputs,
+ * polling and reading all of them from the event loop becomes the
+ * bottleneck during bursts. Inputs are then sharded across <n> threads,
+ * input i going to thread i % n, each with its own epoll set. Threads
+ * only read: batches of events are queued with their read time in a
+ * single producer/single consumer ring per thread, and the event loop
+ * (woken up by an eventfd) runs them through the key state machine as
+ * if it had read them itself. Key state stays in the event loop, as
+ * bindings apply to keys from all inputs.
+ *
+ * Rings and counters are lock-free. Each thread holds its mutex while
+ * reading, so reopen_input can take an input away from it.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "buttond.h"
+
+#define READERS_MAX 64
+/* batches per ring */
+#define READER_RING_SIZE 256
+/* events per batch, i.e. per read() */
+#define READER_BATCH 32
+
+struct reader_batch {
+	int input;
+	int count;
+	struct timespec read_time;
+	struct input_event events[READER_BATCH];
+};
+
+struct reader {
+	pthread_t thread;
+	int epoll_fd;
+	/* thread waits on this when its ring is full */
+	int space_fd;
+	pthread_mutex_t lock;
+	struct reader_batch *ring;
+	/* batches ever queued/handled, ring index is modulo size */
+	atomic_uint_fast64_t head;
+	atomic_uint_fast64_t tail;
+	/* ready_fd written and not drained yet */
+	atomic_bool pending;
+	atomic_bool waiting;
+	/* stats, for metrics and control */
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t events;
+	atomic_uint_fast64_t stalls;
+};
+
+static int reader_count;
+static struct reader *readers;
+/* per input, fd being read (-1 if none) owned by its reader's lock */
+static int *input_fds;
+/* per input, set by reader once it stopped reading */
+enum input_failure {
+	INPUT_OK,
+	/* end of file, tests.sh pipes are done */
+	INPUT_EOF,
+	/* read error or partial event */
+	INPUT_ERROR,
+};
+static atomic_int *input_failed;
+static int *input_reopen;
+/* wakes up the event loop */
+static int ready_fd = -1;
+
+void readers_set_count(const char *count) {
+	reader_count = strtoint(count);
+	xassert(errno == 0 && reader_count >= 0 && reader_count <= READERS_MAX,
+		"Invalid reader threads count %s (max %d)", count, READERS_MAX);
+}
+
+bool readers_enabled(void) {
+	return readers != NULL;
+}
+
+static struct reader *input_reader(int i) {
+	return &readers[i % reader_count];
+}
+
+static void reader_notify(struct reader *reader) {
+	uint64_t one = 1;
+
+	if (atomic_exchange(&reader->pending, true))
+		return;
+	if (write(ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "reader: could not wake up event loop: %m\n");
+}
+
+/* read input until it would block, returns true if ring is full */
+static bool reader_read(struct reader *reader, int i) {
+	int fd = input_fds[i];
+
+	/* removed since epoll_wait returned */
+	if (fd < 0)
+		return false;
+	while (1) {
+		uint64_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+		uint64_t tail = atomic_load_explicit(&reader->tail, memory_order_acquire);
+		if (head - tail >= READER_RING_SIZE) {
+			atomic_fetch_add_explicit(&reader->stalls, 1, memory_order_relaxed);
+			return true;
+		}
+
+		struct reader_batch *batch = &reader->ring[head % READER_RING_SIZE];
+		ssize_t n = read(fd, batch->events, sizeof(batch->events));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return false;
+		if (n <= 0 || n % sizeof(batch->events[0]) != 0) {
+			/* event loop reopens it after handling queued batches */
+			epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			input_fds[i] = -1;
+			atomic_store_explicit(&input_failed[i],
+					      n == 0 ? INPUT_EOF : INPUT_ERROR,
+					      memory_order_release);
+			reader_notify(reader);
+			return false;
+		}
+		batch->input = i;
+		batch->count = n / sizeof(batch->events[0]);
+		time_gettime(&batch->read_time);
+		atomic_store_explicit(&reader->head, head + 1, memory_order_release);
+		atomic_fetch_add_explicit(&reader->reads, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&reader->events, batch->count,
+					  memory_order_relaxed);
+		reader_notify(reader);
+	}
+}
+
+static void reader_wait_space(struct reader *reader) {
+	uint64_t value;
+
+	atomic_store(&reader->waiting, true);
+	/* event loop might have drained everything before seeing the flag */
+	if (atomic_load(&reader->head) - atomic_load(&reader->tail)
+	    < READER_RING_SIZE) {
+		atomic_store(&reader->waiting, false);
+		return;
+	}
+	while (read(reader->space_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+}
+
+static void *reader_run(void *arg) {
+	struct reader *reader = arg;
+	struct epoll_event ready[16];
+
+	while (1) {
+		int n = epoll_wait(reader->epoll_fd, ready,
+				   sizeof(ready) / sizeof(ready[0]), -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		xassert(n >= 0, "reader: epoll failure: %m");
+
+		bool full = false;
+		pthread_mutex_lock(&reader->lock);
+		for (int e = 0; e < n && !full; e++)
+			full = reader_read(reader, ready[e].data.u32);
+		pthread_mutex_unlock(&reader->lock);
+		if (full)
+			reader_wait_space(reader);
+	}
+	return NULL;
+}
+
+/* input i was (re)opened as pollfds[i] */
+void readers_add(struct state *state, int i) {
+	if (!readers)
+		return;
+	struct reader *reader = input_reader(i);
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u32 = i,
+	};
+
+	pthread_mutex_lock(&reader->lock);
+	input_fds[i] = state->pollfds[i].fd;
+	xassert(epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, input_fds[i], &event) == 0,
+		"Could not add %s to reader: %m", state->input_files[i].filename);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/* input i is about to be closed */
+void readers_remove(struct state *state, int i) {
+	(void)state;
+	if (!readers)
+		return;
+	struct reader *reader = input_reader(i);
+
+	pthread_mutex_lock(&reader->lock);
+	/* already removed by reader on failure */
+	if (input_fds[i] >= 0)
+		epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, input_fds[i], NULL);
+	input_fds[i] = -1;
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/* start threads once inputs are open, signals must already be blocked */
+void readers_start(struct state *state) {
+	if (reader_count > state->input_count)
+		reader_count = state->input_count;
+	if (!reader_count)
+		return;
+
+	ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	xassert(ready_fd >= 0, "Could not create eventfd: %m");
+	pollfd_slot(state, POLLFD_READERS)->fd = ready_fd;
+	pollfd_slot(state, POLLFD_READERS)->events = POLLIN;
+
+	input_fds = xcalloc(state->input_count, sizeof(*input_fds));
+	input_failed = xcalloc(state->input_count, sizeof(*input_failed));
+	input_reopen = xcalloc(state->input_count, sizeof(*input_reopen));
+	for (int i = 0; i < state->input_count; i++)
+		input_fds[i] = -1;
+	readers = xcalloc(reader_count, sizeof(*readers));
+	for (int r = 0; r < reader_count; r++) {
+		struct reader *reader = &readers[r];
+
+		reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		reader->space_fd = eventfd(0, EFD_CLOEXEC);
+		xassert(reader->epoll_fd >= 0 && reader->space_fd >= 0,
+			"Could not create reader: %m");
+		pthread_mutex_init(&reader->lock, NULL);
+		reader->ring = xcalloc(READER_RING_SIZE, sizeof(*reader->ring));
+	}
+	for (int i = 0; i < state->input_count; i++) {
+		if (state->pollfds[i].fd >= 0)
+			readers_add(state, i);
+	}
+	for (int r = 0; r < reader_count; r++) {
+		errno = pthread_create(&readers[r].thread, NULL, reader_run,
+				       &readers[r]);
+		xassert(errno == 0, "Could not start reader thread: %m");
+	}
+	if (state->ctx.debug)
+		log_printf("reading %d inputs from %d threads\n",
+			   state->input_count, reader_count);
+}
+
+static void reader_drain(struct state *state, struct reader *reader) {
+	uint64_t one = 1;
+	uint64_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&reader->head, memory_order_acquire);
+	for (; tail != head; tail++) {
+		struct reader_batch *batch = &reader->ring[tail % READER_RING_SIZE];
+
+		if (state->idle_count)
+			idle_activity(state, batch->input, &batch->read_time);
+		input_events(state, batch->input, batch->events, batch->count,
+			     &batch->read_time);
+		/* give the slot back right away */
+		atomic_store_explicit(&reader->tail, tail + 1, memory_order_release);
+	}
+	if (atomic_exchange(&reader->waiting, false)
+	    && write(reader->space_fd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "reader: could not wake up reader: %m\n");
+}
+
+void readers_handle(struct state *state) {
+	uint64_t value;
+
+	if (!readers || !pollfd_slot(state, POLLFD_READERS)->revents)
+		return;
+	if (read(ready_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "reader: could not read eventfd: %m\n");
+
+	/* cleared first: anything queued or failing from now on wakes us
+	 * up again, even if it happens before we looked at it */
+	for (int r = 0; r < reader_count; r++)
+		atomic_store(&readers[r].pending, false);
+	/* failures seen now come after all their input's queued batches */
+	for (int i = 0; i < state->input_count; i++)
+		input_reopen[i] = atomic_exchange_explicit(&input_failed[i], INPUT_OK,
+							   memory_order_acquire);
+	for (int r = 0; r < reader_count; r++)
+		reader_drain(state, &readers[r]);
+	for (int i = 0; i < state->input_count; i++) {
+		if (input_reopen[i] == INPUT_OK)
+			continue;
+		/* as for HUP in the event loop */
+		if (input_reopen[i] == INPUT_EOF && state->test_mode)
+			exit(0);
+		fprintf(stderr, "read error on %s. Trying to reopen\n",
+			state->input_files[i].filename);
+		reopen_input(state, i);
+	}
+}
+
+/* returns false past last reader */
+bool readers_stats(int r, struct reader_stats *stats) {
+	if (!readers || r >= reader_count)
+		return false;
+	stats->reads = atomic_load_explicit(&readers[r].reads, memory_order_relaxed);
+	stats->events = atomic_load_explicit(&readers[r].events, memory_order_relaxed);
+	stats->stalls = atomic_load_explicit(&readers[r].stalls, memory_order_relaxed);
+	return true;
+}
@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Flight recorder (--recorder <file>): the last --recorder-size raw
+ * events, key state transitions and actions run are kept as binary
+ * records in a ring, and only formatted when dumped to <file>:
+ * on SIGUSR1, with the `dump` control command, on fatal signals and on
+ * failure exits.
+ *
+ * Dumping only uses async-signal-safe calls (open, write and a local
+ * number formatter) so the same code serves the crash handler.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+
+#include "buttond.h"
+
+#define RECORDER_DEFAULT_SIZE 1024
+
+enum record_kind {
+	RECORD_EVENT,
+	RECORD_STATE,
+	RECORD_ACTION,
+};
+
+struct record {
+	/* event timestamp for events, time recorded otherwise */
+	int64_t sec;
+	int32_t usec;
+	uint8_t kind;
+	/* event: input index, state: old state, action: see action_types */
+	uint8_t arg;
+	uint16_t type;
+	uint16_t code;
+	/* event value, new state or action duration */
+	int32_t value;
+};
+
+static const char *action_types[] = {
+	[RECORD_ACTION_SHORT] = "short",
+	[RECORD_ACTION_LONG] = "long",
+	[RECORD_ACTION_STAGE] = "stage",
+	[RECORD_ACTION_CANCEL] = "cancel",
+};
+
+static const char *state_names[] = {
+	[BUTTOND_KEY_RELEASED] = "released",
+	[BUTTOND_KEY_PRESSED] = "pressed",
+	[BUTTOND_KEY_DEBOUNCE] = "debounce",
+	[BUTTOND_KEY_HANDLED] = "handled",
+};
+
+static const char *recorder_path;
+static struct record *ring;
+static uint32_t ring_size = RECORDER_DEFAULT_SIZE;
+/* total records ever written, ring index is modulo size */
+static uint64_t record_count;
+static volatile sig_atomic_t dump_requested;
+
+void recorder_set_file(const char *path) {
+	recorder_path = path;
+}
+
+void recorder_set_size(const char *size) {
+	ring_size = strtoint(size);
+	xassert(errno == 0 && ring_size > 0, "Invalid recorder size %s", size);
+}
+
+static struct record *record_next(void) {
+	return &ring[record_count++ % ring_size];
+}
+
+void recorder_event(int input, const struct input_event *event) {
+	if (!ring)
+		return;
+	struct record *record = record_next();
+	record->sec = event->input_event_sec;
+	record->usec = event->input_event_usec;
+	record->kind = RECORD_EVENT;
+	record->arg = input;
+	record->type = event->type;
+	record->code = event->code;
+	record->value = event->value;
+}
+
+static struct record *record_now(enum record_kind kind) {
+	struct timespec now;
+	struct record *record = record_next();
+
+	time_gettime(&now);
+	record->sec = now.tv_sec;
+	record->usec = now.tv_nsec / NSECS_IN_USEC;
+	record->kind = kind;
+	record->type = 0;
+	return record;
+}
+
+void recorder_state(struct buttond_key *key, enum buttond_key_state old_state) {
+	if (!ring)
+		return;
+	struct record *record = record_now(RECORD_STATE);
+	record->arg = old_state;
+	record->code = key->code;
+	record->value = key->state;
+}
+
+void recorder_action(struct buttond_key *key, enum record_action type,
+		     int64_t duration) {
+	if (!ring)
+		return;
+	struct record *record = record_now(RECORD_ACTION);
+	record->arg = type;
+	record->code = key->code;
+	record->value = duration > INT32_MAX ? INT32_MAX : duration;
+}
+
+/* async-signal-safe output helpers */
+struct dump_buf {
+	char data[512];
+	size_t len;
+};
+
+static void dump_str(struct dump_buf *buf, const char *str) {
+	while (*str && buf->len < sizeof(buf->data))
+		buf->data[buf->len++] = *str++;
+}
+
+static void dump_int(struct dump_buf *buf, int64_t value, int width) {
+	char digits[24];
+	int n = 0;
+	uint64_t abs = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+	do {
+		digits[n++] = '0' + abs % 10;
+		abs /= 10;
+	} while (abs || n < width);
+	if (value < 0 && buf->len < sizeof(buf->data))
+		buf->data[buf->len++] = '-';
+	while (n && buf->len < sizeof(buf->data))
+		buf->data[buf->len++] = digits[--n];
+}
+
+static void dump_record(struct dump_buf *buf, const struct record *record) {
+	dump_int(buf, record->sec, 0);
+	dump_str(buf, ".");
+	dump_int(buf, record->usec, 6);
+	switch (record->kind) {
+	case RECORD_EVENT:
+		dump_str(buf, " event input=");
+		dump_int(buf, record->arg, 0);
+		dump_str(buf, " type=");
+		dump_int(buf, record->type, 0);
+		dump_str(buf, " code=");
+		dump_int(buf, record->code, 0);
+		if (record->type == EV_KEY) {
+			dump_str(buf, " key=");
+			dump_str(buf, buttond_keyname(record->code));
+		}
+		dump_str(buf, " value=");
+		dump_int(buf, record->value, 0);
+		break;
+	case RECORD_STATE:
+		dump_str(buf, " state key=");
+		dump_str(buf, buttond_keyname(record->code));
+		dump_str(buf, " from=");
+		dump_str(buf, state_names[record->arg]);
+		dump_str(buf, " to=");
+		dump_str(buf, state_names[record->value]);
+		break;
+	case RECORD_ACTION:
+		dump_str(buf, " action key=");
+		dump_str(buf, buttond_keyname(record->code));
+		dump_str(buf, " type=");
+		dump_str(buf, action_types[record->arg]);
+		dump_str(buf, " duration_ms=");
+		dump_int(buf, record->value, 0);
+		break;
+	}
+	dump_str(buf, "\n");
+}
+
+/* returns false if file could not be written */
+static bool recorder_write(void) {
+	int fd = open(recorder_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	uint64_t first = record_count > ring_size ? record_count - ring_size : 0;
+	bool ok = true;
+	for (uint64_t i = first; i < record_count && ok; i++) {
+		struct dump_buf buf = { .len = 0 };
+		dump_record(&buf, &ring[i % ring_size]);
+		ok = write(fd, buf.data, buf.len) == (ssize_t)buf.len;
+	}
+	close(fd);
+	return ok;
+}
+
+bool recorder_dump(struct state *state) {
+	if (!ring)
+		return false;
+	if (state->ctx.debug)
+		log_printf("dumping %"PRIu64" records to %s\n",
+			   record_count > ring_size ? ring_size : record_count,
+			   recorder_path);
+	bool ok = recorder_write();
+	if (!ok)
+		fprintf(stderr, "Could not write %s: %m\n", recorder_path);
+	return ok;
+}
+
+static void recorder_request(int sig) {
+	(void)sig;
+	dump_requested = 1;
+}
+
+static void recorder_crash(int sig) {
+	recorder_write();
+	/* SA_RESETHAND: default action kills us with the same signal */
+	raise(sig);
+}
+
+static void recorder_exit(int status, void *arg) {
+	(void)arg;
+	if (status != EXIT_SUCCESS)
+		recorder_write();
+}
+
+void recorder_init(sigset_t *blocked) {
+	static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+	if (!recorder_path)
+		return;
+	ring = xcalloc(ring_size, sizeof(*ring));
+
+	struct sigaction sa = {
+		.sa_handler = recorder_request,
+	};
+	sigemptyset(&sa.sa_mask);
+	xassert(sigaction(SIGUSR1, &sa, NULL) == 0,
+		"Could not setup SIGUSR1 handler: %m");
+	/* only deliver in poll, like SIGUSR2 */
+	sigaddset(blocked, SIGUSR1);
+
+	sa.sa_handler = recorder_crash;
+	sa.sa_flags = SA_RESETHAND;
+	for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+		sigaction(fatal[i], &sa, NULL);
+	/* xassert failures */
+	on_exit(recorder_exit, NULL);
+}
+
+void recorder_check(struct state *state) {
+	if (!dump_requested)
+		return;
+	dump_requested = 0;
+	recorder_dump(state);
+}
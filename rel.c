@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Relative axes, e.g. rotary encoders (--rel, --rel-file): deltas are
+ * summed per SYN_REPORT frame, and frames are summed over a batching
+ * window starting with the first frame, after which a single action
+ * runs with the net delta. Fast spinning thus only runs one command per
+ * window instead of one per detent.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+
+#include "buttond.h"
+
+struct rel {
+	/* must stay first, see rel_fire */
+	struct timer timer;
+	uint16_t code;
+	int window_msecs;
+	/* command with BUTTOND_DELTA, or file to add delta to */
+	const char *command;
+	const char *file;
+	/* current (incomplete) frame and window */
+	int frame_delta;
+	int delta;
+	const char *source;
+};
+
+static const char *rel_names[] = {
+	[REL_X] = "REL_X",
+	[REL_Y] = "REL_Y",
+	[REL_Z] = "REL_Z",
+	[REL_RX] = "REL_RX",
+	[REL_RY] = "REL_RY",
+	[REL_RZ] = "REL_RZ",
+	[REL_HWHEEL] = "REL_HWHEEL",
+	[REL_DIAL] = "REL_DIAL",
+	[REL_WHEEL] = "REL_WHEEL",
+	[REL_MISC] = "REL_MISC",
+	[REL_WHEEL_HI_RES] = "REL_WHEEL_HI_RES",
+	[REL_HWHEEL_HI_RES] = "REL_HWHEEL_HI_RES",
+};
+
+static int rel_code(const char *name) {
+	for (size_t i = 0; i < sizeof(rel_names) / sizeof(rel_names[0]); i++) {
+		/* REL_ prefix is optional */
+		if (rel_names[i] && (strcasecmp(rel_names[i], name) == 0
+				     || strcasecmp(rel_names[i] + 4, name) == 0))
+			return i;
+	}
+	int code = strtoint(name);
+	if (errno || code > REL_MAX)
+		return -1;
+	return code;
+}
+
+static const char *rel_name(uint16_t code) {
+	if (code >= sizeof(rel_names) / sizeof(rel_names[0]) || !rel_names[code])
+		return "";
+	return rel_names[code];
+}
+
+/* add delta to integer in file, clamped to 0 and max_brightness if
+ * there is one next to it */
+static void rel_write_file(struct state *state, struct rel *rel) {
+	char buf[32], path[PATH_MAX];
+	long value, max = -1;
+
+	int fd = open(rel->file, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s: %m\n", rel->file);
+		return;
+	}
+	int n = read_safe(fd, buf, sizeof(buf) - 1);
+	buf[n > 0 ? n : 0] = 0;
+	value = strtol(buf, NULL, 10);
+
+	const char *slash = strrchr(rel->file, '/');
+	int dirlen = slash ? slash - rel->file + 1 : 0;
+	if (snprintf(path, sizeof(path), "%.*smax_brightness",
+		     dirlen, rel->file) < (int)sizeof(path)) {
+		int max_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (max_fd >= 0) {
+			n = read_safe(max_fd, buf, sizeof(buf) - 1);
+			close(max_fd);
+			buf[n > 0 ? n : 0] = 0;
+			max = strtol(buf, NULL, 10);
+		}
+	}
+
+	value += rel->delta;
+	if (value < 0)
+		value = 0;
+	if (max >= 0 && value > max)
+		value = max;
+	n = snprintf(buf, sizeof(buf), "%ld\n", value);
+	if (state->ctx.debug)
+		log_printf("writing %ld to %s\n", value, rel->file);
+	if (pwrite(fd, buf, n, 0) != n)
+		fprintf(stderr, "Could not write %s: %m\n", rel->file);
+	/* regular files (tests) could have had a longer value */
+	if (ftruncate(fd, n) < 0 && errno != EINVAL && errno != EPERM)
+		fprintf(stderr, "Could not truncate %s: %m\n", rel->file);
+	close(fd);
+}
+
+static void rel_fire(struct state *state, struct timer *timer) {
+	/* timer is the first field */
+	struct rel *rel = (struct rel *)timer;
+
+	if (!rel->delta)
+		return;
+	if (state->ctx.debug)
+		log_printf("axis %s (%d) moved by %d\n", rel_name(rel->code),
+			   rel->code, rel->delta);
+	struct buttond_key axis = {
+		.code = rel->code,
+		.name = rel_name(rel->code),
+		.source = rel->source,
+	};
+	if (dry_run_action(&axis, "rel", 0, &rel->timer.deadline,
+			   rel->file ? rel->file : rel->command)) {
+		/* counted only */
+	} else if (rel->file) {
+		rel_write_file(state, rel);
+	} else {
+		spawn_set_env(&axis, "rel", 0);
+		spawn_set_delta(rel->delta);
+		spawn_wait(rel->command);
+	}
+	rel->delta = 0;
+}
+
+/* <axis>:<window ms>:<command or file> */
+void rel_add(struct state *state, char *spec, bool file) {
+	char *window = strchr(spec, ':');
+	char *target = window ? strchr(window + 1, ':') : NULL;
+	xassert(target, "--rel expects <axis>:<window ms>:<%s>, got %s",
+		file ? "file" : "command", spec);
+	*window++ = 0;
+	*target++ = 0;
+
+	state->rels = xreallocarray(state->rels, state->rel_count + 1,
+				    sizeof(*state->rels));
+	struct rel *rel = &state->rels[state->rel_count++];
+	memset(rel, 0, sizeof(*rel));
+	int code = rel_code(spec);
+	xassert(code >= 0, "Unknown relative axis %s", spec);
+	rel->code = code;
+	rel->window_msecs = strtoint(window);
+	xassert(errno == 0, "Invalid batching window %s", window);
+	if (file)
+		rel->file = target;
+	else
+		rel->command = target;
+}
+
+void rel_start(struct state *state) {
+	/* array can no longer move: timers point into it */
+	for (int i = 0; i < state->rel_count; i++)
+		timer_register(state, &state->rels[i].timer, rel_fire);
+}
+
+void rel_handle_event(struct state *state, struct input_event *event,
+		      const char *source) {
+	for (int i = 0; i < state->rel_count; i++) {
+		struct rel *rel = &state->rels[i];
+
+		if (event->type == EV_REL && event->code == rel->code) {
+			rel->frame_delta += event->value;
+			continue;
+		}
+		if (event->type != EV_SYN || !rel->frame_delta)
+			continue;
+		if (event->code == SYN_DROPPED) {
+			rel->frame_delta = 0;
+			continue;
+		}
+		if (event->code != SYN_REPORT)
+			continue;
+		rel->delta += rel->frame_delta;
+		rel->frame_delta = 0;
+		rel->source = source;
+		if (!rel->timer.armed) {
+			struct timespec now;
+			time_gettime(&now);
+			timer_arm(&rel->timer, &now, rel->window_msecs);
+		}
+	}
+}
@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Optional key state snapshot (--state-file): press times of held keys
+ * are kept in a small mmap'd file on every transition, so a restarted
+ * buttond can keep counting long presses from the original press.
+ *
+ * The file is a header followed by one fixed-size record per key,
+ * for all layers in order. While a key is held the header is stamped
+ * every SNAPSHOT_ALIVE_MSECS: records older than that plus
+ * SNAPSHOT_ALIVE_GRACE_MSECS on startup are ignored, as keys could
+ * have been released and pressed again while we were not running.
+ * It is never synced: it only needs to survive the process (e.g. in
+ * /run), not the machine.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "buttond.h"
+
+#define SNAPSHOT_MAGIC 0x73647462 /* "btds" */
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIVE_MSECS 1000
+#define SNAPSHOT_ALIVE_GRACE_MSECS 1000
+
+struct snapshot_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;
+	uint32_t pad;
+	/* CLOCK_MONOTONIC time we last knew records were current */
+	int64_t alive_sec;
+	int64_t alive_nsec;
+};
+
+struct snapshot_record {
+	uint16_t code;
+	uint8_t state;
+	uint8_t layer;
+	uint8_t pad[4];
+	int64_t pressed_sec;
+	int64_t pressed_usec;
+};
+
+struct snapshot {
+	/* must stay first, see snapshot_alive */
+	struct timer timer;
+	struct snapshot_header *header;
+	struct snapshot_record *records;
+	size_t size;
+	/* copy of records found at startup, until snapshot_forget */
+	struct snapshot_record *old;
+	uint32_t old_count;
+};
+
+static void load_old_records(struct state *state, struct snapshot *snapshot,
+			     int fd) {
+	struct snapshot_header header;
+	struct timespec now, alive;
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(header))
+		return;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return;
+	if (header.magic != SNAPSHOT_MAGIC
+	    || header.version != SNAPSHOT_VERSION
+	    || header.record_size != sizeof(struct snapshot_record)
+	    || (off_t)(sizeof(header) + header.count * sizeof(*snapshot->old)) > sb.st_size)
+		return;
+	/* also covers a file left from a previous boot */
+	time_gettime(&now);
+	alive.tv_sec = header.alive_sec;
+	alive.tv_nsec = header.alive_nsec;
+	long age = time_diff_ts(&now, &alive);
+	if (age < 0 || age > SNAPSHOT_ALIVE_MSECS + SNAPSHOT_ALIVE_GRACE_MSECS) {
+		if (state->ctx.debug)
+			log_printf("ignoring state file last updated %ldms ago\n", age);
+		return;
+	}
+	snapshot->old = xcalloc(header.count, sizeof(*snapshot->old));
+	ssize_t len = header.count * sizeof(*snapshot->old);
+	if (pread(fd, snapshot->old, len, sizeof(header)) != len) {
+		free(snapshot->old);
+		snapshot->old = NULL;
+		return;
+	}
+	snapshot->old_count = header.count;
+}
+
+static int key_index(struct state *state, struct buttond_key *key, int *layer) {
+	int base = 0;
+
+	for (int l = 0; l < state->ctx.layer_count; l++) {
+		struct buttond_layer *cur = &state->ctx.layers[l];
+		if (key >= cur->keys && key < cur->keys + cur->key_count) {
+			if (layer)
+				*layer = l;
+			return base + (key - cur->keys);
+		}
+		base += cur->key_count;
+	}
+	return -1;
+}
+
+/* stamp header, keeping it stamped while a key is held */
+static void snapshot_stamp(struct snapshot *snapshot) {
+	struct timespec now;
+
+	time_gettime(&now);
+	snapshot->header->alive_sec = now.tv_sec;
+	snapshot->header->alive_nsec = now.tv_nsec;
+	for (uint32_t i = 0; i < snapshot->header->count; i++) {
+		if (snapshot->records[i].state != BUTTOND_KEY_RELEASED) {
+			timer_arm(&snapshot->timer, &now, SNAPSHOT_ALIVE_MSECS);
+			return;
+		}
+	}
+	timer_disarm(&snapshot->timer);
+}
+
+static void snapshot_alive(struct state *state, struct timer *timer) {
+	(void)state;
+	/* timer is the first field */
+	snapshot_stamp((struct snapshot *)timer);
+}
+
+void snapshot_open(struct state *state, const char *path) {
+	struct snapshot *snapshot = xcalloc(1, sizeof(*snapshot));
+	int count = 0;
+
+	for (int l = 0; l < state->ctx.layer_count; l++)
+		count += state->ctx.layers[l].key_count;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	xassert(fd >= 0, "Could not open state file %s: %m", path);
+	load_old_records(state, snapshot, fd);
+
+	snapshot->size = sizeof(*snapshot->header)
+		+ count * sizeof(*snapshot->records);
+	xassert(ftruncate(fd, snapshot->size) == 0,
+		"Could not resize state file %s: %m", path);
+	snapshot->header = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	xassert(snapshot->header != MAP_FAILED,
+		"Could not map state file %s: %m", path);
+	close(fd);
+
+	snapshot->records = (struct snapshot_record *)(snapshot->header + 1);
+	memset(snapshot->header, 0, snapshot->size);
+	state->snapshot = snapshot;
+	timer_register(state, &snapshot->timer, snapshot_alive);
+	/* keys can already be set if we were upgraded */
+	for (int l = 0; l < state->ctx.layer_count; l++) {
+		struct buttond_layer *layer = &state->ctx.layers[l];
+		for (int i = 0; i < layer->key_count; i++)
+			snapshot_update(state, &layer->keys[i]);
+	}
+	snapshot->header->version = SNAPSHOT_VERSION;
+	snapshot->header->record_size = sizeof(*snapshot->records);
+	snapshot->header->count = count;
+	snapshot_stamp(snapshot);
+	/* magic last: a torn header is ignored on next start */
+	snapshot->header->magic = SNAPSHOT_MAGIC;
+}
+
+void snapshot_update(struct state *state, struct buttond_key *key) {
+	struct snapshot *snapshot = state->snapshot;
+	if (!snapshot)
+		return;
+
+	int layer = 0;
+	int idx = key_index(state, key, &layer);
+	if (idx < 0)
+		return;
+	struct snapshot_record *record = &snapshot->records[idx];
+	record->code = key->code;
+	record->layer = layer;
+	record->pressed_sec = key->tv_pressed.tv_sec;
+	record->pressed_usec = key->tv_pressed.tv_usec;
+	record->state = key->state;
+	snapshot_stamp(snapshot);
+}
+
+/* key was found held on startup: if it was already held according to
+ * previous instance, resume from there. Returns true if key was handled */
+bool snapshot_restore_key(struct state *state, struct buttond_key *key) {
+	struct snapshot *snapshot = state->snapshot;
+	if (!snapshot || !snapshot->old)
+		return false;
+
+	for (uint32_t i = 0; i < snapshot->old_count; i++) {
+		struct snapshot_record *record = &snapshot->old[i];
+		if (record->code != key->code
+		    || record->layer != state->ctx.layer)
+			continue;
+		if (record->state == BUTTOND_KEY_RELEASED
+		    || record->state > BUTTOND_KEY_HANDLED)
+			return false;
+
+		struct timeval tv_pressed = {
+			.tv_sec = record->pressed_sec,
+			.tv_usec = record->pressed_usec,
+		};
+		struct timespec pressed;
+		time_tv2ts(&pressed, &tv_pressed, 0);
+		if (state->ctx.debug)
+			log_printf("key %s (%d) resumed from state file, pressed at %ld.%03ld\n",
+				   key->name, key->code, (long)tv_pressed.tv_sec,
+				   (long)tv_pressed.tv_usec / 1000);
+		/* if the long press already ran, wait for release */
+		buttond_resume_key(&state->ctx, key, &pressed,
+				   record->state == BUTTOND_KEY_HANDLED);
+		return true;
+	}
+	return false;
+}
+
+/* previous state is only meaningful for the initial open */
+void snapshot_forget(struct state *state) {
+	if (!state->snapshot)
+		return;
+	free(state->snapshot->old);
+	state->snapshot->old = NULL;
+	state->snapshot->old_count = 0;
+}
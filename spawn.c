@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Running action commands with /bin/sh -c, with context in the
+ * environment so a single script can serve several bindings:
+ *   BUTTOND_KEY, BUTTOND_CODE: key name and code
+ *   BUTTOND_DURATION_MS: how long the key was held
+ *   BUTTOND_DEVICE: input the key press came from
+ *   BUTTOND_ACTION_TYPE: short, long, stage, cancel, idle, resume or rel
+ *   BUTTOND_DELTA: net movement for rel, empty otherwise
+ * The environment array is built once at startup with fixed buffers
+ * for these, spawn_set_env only formats the values in place.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "buttond.h"
+
+#define ENV_PREFIX "BUTTOND_"
+
+enum spawn_env {
+	ENV_KEY,
+	ENV_CODE,
+	ENV_DURATION,
+	ENV_DEVICE,
+	ENV_TYPE,
+	ENV_DELTA,
+	ENV_COUNT,
+};
+
+static const char *env_names[ENV_COUNT] = {
+	[ENV_KEY] = ENV_PREFIX "KEY",
+	[ENV_CODE] = ENV_PREFIX "CODE",
+	[ENV_DURATION] = ENV_PREFIX "DURATION_MS",
+	[ENV_DEVICE] = ENV_PREFIX "DEVICE",
+	[ENV_TYPE] = ENV_PREFIX "ACTION_TYPE",
+	[ENV_DELTA] = ENV_PREFIX "DELTA",
+};
+
+static char env_key[64];
+static char env_code[32];
+static char env_duration[48];
+static char env_device[PATH_MAX + 32];
+static char env_type[48];
+static char env_delta[48];
+static char *env_values[ENV_COUNT] = {
+	[ENV_KEY] = env_key,
+	[ENV_CODE] = env_code,
+	[ENV_DURATION] = env_duration,
+	[ENV_DEVICE] = env_device,
+	[ENV_TYPE] = env_type,
+	[ENV_DELTA] = env_delta,
+};
+static size_t env_sizes[ENV_COUNT] = {
+	[ENV_KEY] = sizeof(env_key),
+	[ENV_CODE] = sizeof(env_code),
+	[ENV_DURATION] = sizeof(env_duration),
+	[ENV_DEVICE] = sizeof(env_device),
+	[ENV_TYPE] = sizeof(env_type),
+	[ENV_DELTA] = sizeof(env_delta),
+};
+static char **envp;
+
+/* must be called after upgrade_restore cleaned up our environment */
+void spawn_init(void) {
+	extern char **environ;
+	int count = 0, n = 0;
+
+	while (environ[count])
+		count++;
+	envp = xcalloc(count + ENV_COUNT + 1, sizeof(*envp));
+	for (int i = 0; i < count; i++) {
+		/* ours would be stale if we were started from an action */
+		if (strncmp(environ[i], ENV_PREFIX, strlen(ENV_PREFIX)) == 0)
+			continue;
+		envp[n++] = environ[i];
+	}
+	for (int i = 0; i < ENV_COUNT; i++) {
+		snprintf(env_values[i], env_sizes[i], "%s=", env_names[i]);
+		envp[n++] = env_values[i];
+	}
+	envp[n] = NULL;
+}
+
+static void env_set(enum spawn_env env, const char *fmt, ...) {
+	va_list ap;
+	int len = strlen(env_names[env]) + 1;
+
+	va_start(ap, fmt);
+	vsnprintf(env_values[env] + len, env_sizes[env] - len, fmt, ap);
+	va_end(ap);
+}
+
+/* key can be NULL for actions not related to a key */
+void spawn_set_env(struct buttond_key *key, const char *type, int64_t duration) {
+	env_set(ENV_KEY, "%s", key ? key->name : "");
+	env_set(ENV_CODE, "%d", key ? key->code : 0);
+	env_set(ENV_DURATION, "%"PRId64, duration);
+	env_set(ENV_DEVICE, "%s", key && key->source ? key->source : "");
+	env_set(ENV_TYPE, "%s", type);
+	env_set(ENV_DELTA, "");
+}
+
+void spawn_set_delta(int delta) {
+	env_set(ENV_DELTA, "%d", delta);
+}
+
+/* start command in background, environment from last spawn_set_env.
+ * If output is set, stdout and stderr go to a pipe whose non-blocking
+ * read end is returned there */
+pid_t spawn(const char *command, int *output) {
+	int pipefd[2];
+
+	if (output && pipe2(pipefd, O_CLOEXEC) < 0) {
+		fprintf(stderr, "pipe failed, not capturing output: %m\n");
+		output = NULL;
+	}
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		fprintf(stderr, "fork failed: %m\n");
+		if (output) {
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		return -1;
+	}
+	if (pid == 0) {
+		sigset_t empty;
+		sigemptyset(&empty);
+		sigprocmask(SIG_SETMASK, &empty, NULL);
+		/* own process group so tracked actions can be stopped whole */
+		setpgid(0, 0);
+		/* dup2 clears close on exec */
+		if (output && (dup2(pipefd[1], STDOUT_FILENO) < 0
+			       || dup2(pipefd[1], STDERR_FILENO) < 0))
+			_exit(127);
+		execve("/bin/sh", (char *[]){ "sh", "-c", (char *)command, NULL },
+		       envp);
+		_exit(127);
+	}
+	/* also from here: the group must exist once we return */
+	setpgid(pid, pid);
+	if (output) {
+		close(pipefd[1]);
+		fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+		*output = pipefd[0];
+	}
+	return pid;
+}
+
+/* run command and wait for it, like system() */
+void spawn_wait(const char *command) {
+	struct output *output = output_get(command);
+	struct timespec start;
+	int fd = -1, status;
+
+	time_gettime(&start);
+	pid_t pid = spawn(command, output ? &fd : NULL);
+	if (pid < 0)
+		return;
+	if (fd >= 0)
+		output_wait(output, fd, pid);
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return;
+	}
+	output_done(output, status, &start);
+}
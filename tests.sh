@@ -36,15 +36,16 @@ run_pattern() {
 	declare -a args=( )
 	declare -a inputs=( )
 	declare -a commands=( )
-	local command
+	local command ready="$testname.ready"
 	while [[ $# -gt 0 ]]; do
 		if [[ "$1" = "--" ]]; then
 			shift
+			# generators start as soon as buttond is ready
 			if [[ -z "$DRYRUN" ]]; then
-				exec {FD}< <("$GEN_EVENTS" "${args[@]}")
+				exec {FD}< <("$GEN_EVENTS" --ready "$ready" "${args[@]}")
 				inputs+=( "/proc/self/fd/$FD" )
 			else
-				printf -v command "\"%s\" " "$GEN_EVENTS" "${args[@]}"
+				printf -v command "\"%s\" " "$GEN_EVENTS" --ready "$ready" "${args[@]}"
 				commands+=( "$command" )
 			fi
 			args=( )
@@ -54,19 +55,20 @@ run_pattern() {
 	done
 
 	if [[ -n "$DRYRUN" ]]; then
-		printf '"%s" ' "$BUTTOND" --test_mode
+		printf '"%s" ' "$BUTTOND" --test_mode --ready-fd 3
 		printf -- "<(%s) " "${commands[@]}"
 		printf '"%s" ' "${args[@]}"
-		echo
+		echo "3>$ready"
 		return
 	fi >&2
-	"$BUTTOND" --test_mode "${inputs[@]}" "${args[@]}" &
+	"$BUTTOND" --test_mode --ready-fd 3 "${inputs[@]}" "${args[@]}" 3>"$ready" &
 	PROCESSES[$testname]=$!
 }
 
 run_inotify() {
 	local testname="$1"
 	local pipe="$testname"
+	local ready="${testname//\//_}.ready"
 	shift
 
 	# skip tests we didn't ask for
@@ -86,26 +88,250 @@ run_inotify() {
 	done
 
 	if [[ -n "$DRYRUN" ]]; then
-		printf '"%s" ' "$BUTTOND" --test_mode -i "$pipe" "$@"
-		echo '&'
-		echo "sleep 1"
+		printf '"%s" ' "$BUTTOND" --test_mode --ready-fd 3 -i "$pipe" "$@"
+		echo "3>$ready &"
+		echo "until [ -s $ready ]; do sleep 0.01; done"
 		echo "mkfifo $pipe"
-		printf '"%s" ' "$GEN_EVENTS" "${keys[@]}"
+		printf '"%s" ' "$GEN_EVENTS" --ready "$ready" "${keys[@]}"
 		echo "> $pipe"
 		echo 'wait $!'
 		return
 	fi >&2
 	(
-		"$BUTTOND" --test_mode -i "$pipe" "$@" 2>/dev/null &
+		"$BUTTOND" --test_mode --ready-fd 3 -i "$pipe" "$@" 2>/dev/null 3>"$ready" &
 		BPID=$!
-		sleep 1
+		# input must appear after buttond started watching for it
+		for _ in {1..1000}; do
+			[ -s "$ready" ] && break
+			sleep 0.01
+		done
 		mkfifo "$pipe"
-		"$GEN_EVENTS" "${keys[@]}" > "$pipe"
+		"$GEN_EVENTS" --ready "$ready" "${keys[@]}" > "$pipe"
 		wait $BPID
 	) &
 	PROCESSES[$testname]=$!
 }
 
+# buttond on a uinput device (keys found held on open are only checked
+# for real devices), killed <kill> seconds after it is ready and started
+# again <restart> seconds later; the second run must exit by itself
+run_restart() {
+	local testname="$1" kill_delay="$2" restart_delay="$3"
+	local dev="$testname.dev" ready="$testname.ready"
+	shift 3
+
+	# skip tests we didn't ask for
+	case ",$ONLY," in
+	",,"|*",$testname,"*) ;;
+	*) return;;
+	esac
+
+	declare -a keys=( )
+	while [[ $# -gt 0 ]]; do
+		if [[ "$1" = "--" ]]; then
+			shift
+			break
+		fi
+		keys+=( "$1" )
+		shift
+	done
+
+	if [[ -n "$DRYRUN" ]]; then
+		printf '"%s" ' "$GEN_EVENTS" --uinput "$dev" --ready "$ready" "${keys[@]}"
+		echo '&'
+		printf '"%s" ' "$BUTTOND" --ready-fd 3 "\$(cat $dev)" "$@"
+		echo "3>$ready &"
+		echo "sleep $kill_delay; kill \$!; sleep $restart_delay"
+		printf '"%s" ' "$BUTTOND" "\$(cat $dev)" "$@"
+		echo
+		return
+	fi >&2
+	(
+		"$GEN_EVENTS" --uinput "$dev" --ready "$ready" "${keys[@]}" &
+		for _ in {1..500}; do
+			[ -s "$dev" ] && break
+			sleep 0.01
+		done
+		input=$(cat "$dev") || exit 1
+		"$BUTTOND" --ready-fd 3 "$input" "$@" 2>/dev/null 3>"$ready" &
+		BPID=$!
+		for _ in {1..500}; do
+			[ -s "$ready" ] && break
+			sleep 0.01
+		done
+		sleep "$kill_delay"
+		kill "$BPID"
+		wait "$BPID"
+		sleep "$restart_delay"
+		timeout 20 "$BUTTOND" "$input" "$@" 2>/dev/null
+	) &
+	PROCESSES[$testname]=$!
+}
+
+# buttond with --ff on its input: a uinput device with rumble effects
+# when available, played effect ids are then logged to $testname.ff,
+# else a pipe effects cannot be uploaded to but that must still be read
+run_ff() {
+	local testname="$1" dev="$1.dev" ready="$1.ready"
+	shift
+
+	# skip tests we didn't ask for
+	case ",$ONLY," in
+	",,"|*",$testname,"*) ;;
+	*) return;;
+	esac
+
+	declare -a events=( )
+	while [[ $# -gt 0 ]]; do
+		if [[ "$1" = "--" ]]; then
+			shift
+			break
+		fi
+		events+=( "$1" )
+		shift
+	done
+
+	if [[ -n "$DRYRUN" ]]; then
+		printf '"%s" ' "$GEN_EVENTS" --uinput "$dev" --ff-log "$testname.ff" \
+			--ready "$ready" "${events[@]}"
+		echo '&'
+		printf '"%s" ' "$BUTTOND" --ready-fd 3 "\$(cat $dev)" --ff "\$(cat $dev)" "$@"
+		echo "3>$ready"
+		return
+	fi >&2
+	if [[ ! -w /dev/uinput ]]; then
+		"$BUTTOND" --test_mode --ready-fd 3 /dev/stdin --ff /dev/stdin "$@" \
+			2>/dev/null 3>"$ready" \
+			< <("$GEN_EVENTS" --ready "$ready" "${events[@]}") &
+		PROCESSES[$testname]=$!
+		return
+	fi
+	(
+		"$GEN_EVENTS" --uinput "$dev" --ff-log "$testname.ff" \
+			--ready "$ready" "${events[@]}" &
+		for _ in {1..500}; do
+			[ -s "$dev" ] && break
+			sleep 0.01
+		done
+		input=$(cat "$dev") || exit 1
+		timeout 20 "$BUTTOND" --ready-fd 3 "$input" --ff "$input" "$@" \
+			2>/dev/null 3>"$ready"
+		wait
+	) &
+	PROCESSES[$testname]=$!
+}
+
+# send <command>s to control <socket> in order, one connection each,
+# <delay> seconds after buttond is ready, touching each <file> if the
+# first line of the reply is <expected>
+# usage: send_control <testname> <delay> <socket> [<command> <expected> <file>]...
+send_control() {
+	local testname="$1" delay="$2" socket="$3"
+	shift 3
+
+	# skip tests we didn't ask for
+	case ",$ONLY," in
+	",,"|*",$testname,"*) ;;
+	*) return;;
+	esac
+
+	if [[ -n "$DRYRUN" ]]; then
+		echo "sleep $delay" >&2
+		while [[ $# -gt 0 ]]; do
+			echo "echo '$1' | nc -U $socket" >&2
+			shift 3
+		done
+		return
+	fi
+	(
+		for _ in {1..1000}; do
+			[ -s "$testname.ready" ] && break
+			sleep 0.01
+		done
+		sleep "$delay"
+		python3 -c '
+import socket, sys
+for command, expected, file in zip(*[iter(sys.argv[2:])] * 3):
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(sys.argv[1])
+    sock.sendall(command.encode() + b"\n")
+    reply = b""
+    while data := sock.recv(4096):
+        reply += data
+    sock.close()
+    if reply.decode().split("\n")[0] == expected:
+        open(file, "w").close()
+' "$socket" "$@"
+	) &
+}
+
+# --config-cache: run buttond 4 times on the same events, first writing
+# the cache, then using it, then finding it corrupted and finally with
+# other arguments, both rewriting it. Bindings must act the same in all
+# runs, and cache_hit/cache_corrupt/cache_args mark the expected
+# reuse/rewrites (cache file inode kept or changed)
+run_cache() {
+	local testname=cache
+
+	# skip tests we didn't ask for
+	case ",$ONLY," in
+	",,"|*",$testname,"*) ;;
+	*) return;;
+	esac
+
+	if [[ -n "$DRYRUN" ]]; then
+		echo "# cache: runs buttond --config-cache cache.bin 4 times"
+		return
+	fi >&2
+	(
+		cache_run() {
+			rm -f cache.ready
+			"$BUTTOND" --test_mode --ready-fd 3 /dev/stdin \
+				--config-cache cache.bin "$@" \
+				-s 148 -t 300 -a "echo >> cache_short" \
+				-l 148 -t 500 --stage "echo >> cache_stage" \
+				-l 148 -t 1000 --switch-layer maint \
+				--layer maint -s 148 -a "echo >> cache_maint" \
+				3>cache.ready < <("$GEN_EVENTS" --ready cache.ready \
+					148,1,100 148,0,300 148,1,1200 148,0,300 \
+					148,1,100 148,0,0)
+		}
+		cache_run || exit 1
+		inode=$(stat -c %i cache.bin) || exit 1
+		cache_run || exit 1
+		[[ "$(stat -c %i cache.bin)" = "$inode" ]] && touch cache_hit
+		python3 -c "
+import sys
+with open(\"cache.bin\", \"r+b\") as f:
+    data = bytearray(f.read())
+    data[len(data) // 2] ^= 0xff
+    f.seek(0)
+    f.write(data)"
+		cache_run || exit 1
+		[[ "$(stat -c %i cache.bin)" != "$inode" ]] && touch cache_corrupt
+		inode=$(stat -c %i cache.bin)
+		cache_run --lag-warn 100 || exit 1
+		[[ "$(stat -c %i cache.bin)" != "$inode" ]] && touch cache_args
+	) &
+	PROCESSES[$testname]=$!
+}
+
+send_signal() {
+	local testname="$1" delay="$2" signal="$3"
+
+	# skip tests we didn't ask for
+	case ",$ONLY," in
+	",,"|*",$testname,"*) ;;
+	*) return;;
+	esac
+
+	if [[ -n "$DRYRUN" ]]; then
+		echo "sleep $delay; kill -$signal \$!" >&2
+		return
+	fi
+	( sleep "$delay"; kill "-$signal" "${PROCESSES[$testname]}" ) &
+}
+
 check_fail() {
 	local testname="$1"
 	shift
@@ -301,6 +527,232 @@ run_inotify subdir/mkdir 148,1,100 fdsf 148,0,0  -- \
 	-s 148 -a "touch inotify_mkdir"
 add_check subdir/mkdir e-inotify_mkdir
 
+run_pattern layer 148,1,1200 148,0,100 148,1,100 148,0,0 -- \
+	-s 148 -a "touch layer_default" \
+	-l 148 -t 1000 --switch-layer maint \
+	--layer maint -s 148 -a "touch layer_maint"
+add_check layer ne-layer_default e-layer_maint
+
+# guard_late is created by 148's action and must be seen through inotify
+touch guard_on
+run_pattern guard 148,1,100 148,0,100 149,1,100 149,0,100 150,1,100 150,0,0 -- \
+	-s 148 --if exists:guard_on --unless exists:guard_off -a "touch guard_late" \
+	-s 149 --if exists:guard_late -a "touch guard_149" \
+	-s 150 --if held:148 -a "touch guard_held"
+add_check guard e-guard_late e-guard_149 ne-guard_held
+
+# condition file in directories created later by 148's action: false
+# for 150 before, true for 149 after
+run_pattern guard_mkdir 150,1,100 150,0,100 148,1,100 148,0,100 149,1,100 149,0,0 -- \
+	-s 148 -a "mkdir -p guard_mkdir_dir/sub && touch guard_mkdir_dir/sub/flag" \
+	-s 149 --if exists:guard_mkdir_dir/sub/flag -a "touch guard_mkdir_after" \
+	-s 150 --if exists:guard_mkdir_dir/sub/flag -a "touch guard_mkdir_before"
+add_check guard_mkdir e-guard_mkdir_after ne-guard_mkdir_before
+
+# idle 2.5s after release, resumed by press 2.7s after release
+run_pattern idle 148,1,100 148,0,2700 148,1,100 148,0,0 -- \
+	--idle 2500:"touch idle_idle" --idle-resume "touch idle_resume"
+add_check idle e-idle_idle e-idle_resume
+
+# LED files start empty and end with "0" once a pattern played
+touch led_press led_never
+run_pattern led 148,1,100 148,0,500 -- \
+	-s 148 -a "true" \
+	--led led_press --blink press:148:50,50,2 \
+	--led led_never --blink done:149:50,50,1
+add_check led l1-led_press l0-led_never
+
+# released at 1.5s, between 1s and 2s stages: no action, 1s stage cancelled
+run_pattern stages 148,1,1500 148,0,0 -- \
+	-l 148 -t 1000 --stage "touch stages_1" --cancel "touch stages_cancel" \
+	-l 148 -t 2000 --stage "touch stages_2" -a "touch stages_long"
+add_check stages e-stages_1 e-stages_cancel ne-stages_2 ne-stages_long
+
+# both actions would touch their file 1s after starting, before exit
+run_pattern kill 148,1,1000 148,0,100 149,1,100 149,0,0 -- \
+	-l 148 -t 500 --kill-on-release -a "sleep 1; touch kill_release" \
+	-s 149 --max-runtime 200 -a "sleep 1; touch kill_runtime" \
+	-s 148 -t 400 -a "touch kill_short"
+add_check kill ne-kill_release ne-kill_runtime ne-kill_short
+
+# children of the shell are stopped with it: a background subshell and
+# the other side of a pipeline
+run_pattern kill_group 148,1,100 148,0,300 149,1,100 149,0,1500 -- \
+	-s 148 --max-runtime 200 -a "(sleep 0.5; touch kill_group_bg) & wait" \
+	-s 149 --max-runtime 200 -a "sleep 0.5 | (sleep 0.5; touch kill_group_pipe)"
+add_check kill_group ne-kill_group_bg ne-kill_group_pipe
+
+run_pattern env 148,1,100 148,0,0 -- \
+	-s PROG1 -a '[ "$BUTTOND_KEY $BUTTOND_CODE $BUTTOND_ACTION_TYPE" = "PROG1 148 short" ] \
+		&& [ "$BUTTOND_DURATION_MS" -ge 100 ] && [ -n "$BUTTOND_DEVICE" ] \
+		&& touch env_ok'
+add_check env e-env_ok
+
+# REL_WHEEL (2,8) frames within the 300ms window give a single +1
+run_pattern rel 2,8,1,0 0,0,0,20 2,8,2,0 0,0,0,20 2,8,-2,0 0,0,0,500 -- \
+	--rel REL_WHEEL:300:'echo $BUTTOND_DELTA >> rel_out'
+add_check rel l1-rel_out
+
+# ABS_PRESSURE (3,24) pad: 70 is above release value, so held for 600ms
+run_pattern abs 3,24,120,0 0,0,0,300 3,24,70,0 0,0,0,300 3,24,40,0 0,0,0,0 -- \
+	--abs-threshold pad:ABS_PRESSURE:100:50 \
+	-s pad -t 400 -a "touch abs_short" \
+	-l pad -t 400 -a '[ "$BUTTOND_KEY" = PAD ] && touch abs_long'
+add_check abs e-abs_long ne-abs_short
+
+# joystick ABS_X (3,0) pushed left: -15000 is above the press value but
+# below release, so held for 900ms
+run_pattern abs_negative 3,0,-25000,0 0,0,0,600 3,0,-15000,0 0,0,0,300 3,0,0,0 0,0,0,0 -- \
+	--abs-threshold stick_left:ABS_X:-20000:-10000 \
+	-s stick_left -t 800 -a "touch abs_negative_short" \
+	-l stick_left -t 800 -a "touch abs_negative_long"
+add_check abs_negative e-abs_negative_long ne-abs_negative_short
+
+# 149's action checks metrics written after 148's
+run_pattern metrics 148,1,100 148,0,800 149,1,100 149,0,0 -- \
+	--metrics-file metrics.prom --metrics-interval 300 \
+	-s 148 -a true \
+	-s 149 -a 'grep -qx "buttond_actions_total{key=\"PROG1\",type=\"short\"} 1" metrics.prom \
+		&& touch metrics_ok'
+add_check metrics e-metrics_ok
+
+# one input per reader thread, both feeding the same key state
+run_pattern readers 148,1,100 148,0,800 -- 149,1,600 149,0,300 -- \
+	--reader-threads 2 \
+	-s 148 -a "touch readers_short" \
+	-l 149 -t 500 -a "touch readers_long"
+add_check readers e-readers_short e-readers_long
+
+# the only input of the only reader thread fails and must be reopened
+run_inotify readers_reopen 148,1,100 fdsf 148,0,0 -- \
+	--reader-threads 1 \
+	-s 148 -a "touch readers_reopen_ok"
+add_check readers_reopen e-readers_reopen_ok
+
+# 4 presses: 2 pass the rate limit, the 2 others are suppressed;
+# 149 also runs 2 times as its second press is within the cooldown
+run_pattern ratelimit 148,1,100 148,0,300 148,1,100 148,0,300 148,1,100 148,0,300 \
+		148,1,100 148,0,300 149,1,100 149,0,300 149,1,100 149,0,1200 \
+		149,1,100 149,0,300 -- \
+	-s 148 --rate-limit 2/10000 -a "echo >> ratelimit_148" \
+	-s 149 --cooldown 1000 -a "echo >> ratelimit_149"
+add_check ratelimit l2-ratelimit_148 l2-ratelimit_149
+
+# 148 is pressed in default layer, then again after switching to maint
+# from the control socket
+run_pattern control 148,1,100 148,0,3000 148,1,100 148,0,0 -- \
+	--control control.sock \
+	-s 148 -a "touch control_default" \
+	--layer maint -s 148 -a "touch control_maint"
+send_control control 1.5 control.sock \
+	"layer maint" ok control_switched \
+	layer maint control_query \
+	nope "error: unknown command nope, try help" control_unknown
+add_check control e-control_default e-control_maint e-control_switched \
+	e-control_query e-control_unknown
+
+# 149's tracked action checks 148 is recorded held in the state file,
+# and that the file is kept stamped while buttond waits for its sleep
+run_pattern statefile 148,1,1000 149,1,100 149,0,2500 148,0,0 -- \
+	--state-file statefile.state \
+	-l 148 -t 5000 -a true \
+	-s 149 --max-runtime 5000 -a 'sleep 1.5; python3 -c "
+import struct, time
+data = open(\"statefile.state\", \"rb\").read()
+magic, version, size, count, _, sec, nsec = struct.unpack_from(\"=IHHIIqq\", data)
+records = [struct.unpack_from(\"=HBB4xqq\", data, 32 + i * size) for i in range(count)]
+age = time.clock_gettime(time.CLOCK_MONOTONIC) - sec - nsec / 1e9
+assert magic == 0x73647462 and age < 1.2, age
+assert [r[1] for r in records if r[0] == 148] == [1]
+" && touch statefile_ok'
+add_check statefile e-statefile_ok
+
+if [[ -w /dev/uinput ]]; then
+	# killed while 148 is held: the restarted buttond counts the long
+	# press from the original press, and fires before release
+	run_restart restart 0.5 0.1 148,1,2300 148,0,300 149,1,100 149,0,0 -- \
+		--state-file restart.state \
+		-l 148 -t 2000 -a "touch restart_long" \
+		-s 149 --exit-after -a true
+	add_check restart e-restart_long
+
+	# 148 is pressed again while buttond is not running: its state file
+	# record is too old to be trusted, and 148 is counted from restart
+	run_restart restart_stale 0.3 3.7 148,1,500 148,0,200 148,1,3800 148,0,300 \
+			149,1,100 149,0,0 -- \
+		--state-file restart_stale.state \
+		-l 148 -t 2000 -a "touch restart_stale_long" \
+		-s 149 --exit-after -a "touch restart_stale_exit"
+	add_check restart_stale ne-restart_stale_long e-restart_stale_exit
+fi
+
+# effects play on 148's press and once its action is done, buttond
+# keeps running if they cannot be uploaded
+run_ff ff 148,1,100 148,0,300 149,1,100 149,0,0 -- \
+	--vibrate press:148:50,100,0 --vibrate done:148:50,0,100 \
+	--vibrate press:150:50,100,100 \
+	-s 148 -a "touch ff_short" \
+	-s 149 --exit-after -a true
+add_check ff e-ff_short
+[[ -w /dev/uinput ]] && add_check ff l2-ff.ff
+
+run_cache
+add_check cache l4-cache_short l4-cache_stage l4-cache_maint \
+	e-cache_hit e-cache_corrupt e-cache_args
+
+# actions write to a pipe, more than it holds: read while waiting for
+# 148, from the event loop for tracked 149
+run_pattern capture 148,1,100 148,0,300 149,1,100 149,0,1000 -- \
+	--capture-output 1 \
+	-s 148 -a 'case "$(readlink /proc/$$/fd/1) $(readlink /proc/$$/fd/2)" in
+		"pipe:"*" pipe:"*) head -c 200000 /dev/zero && touch capture_wait;; esac' \
+	-s 149 --max-runtime 5000 -a 'head -c 200000 /dev/zero && touch capture_tracked'
+add_check capture e-capture_wait e-capture_tracked
+
+# 148's action asks for a dump, checked by 149's action
+run_pattern recorder 148,1,100 148,0,300 149,1,100 149,0,0 -- \
+	--recorder recorder_dump \
+	-s 148 -a 'kill -USR1 $PPID' \
+	-s 149 -a 'grep -q "action key=PROG1 type=short" recorder_dump \
+		&& grep -q "state key=PROG1 from=released to=pressed" recorder_dump \
+		&& touch recorder_ok'
+add_check recorder e-recorder_ok
+
+# nothing runs, not even exit-after: both actions and summary are logged
+run_pattern dryrun 148,1,100 148,0,300 148,1,1200 148,0,0 -- \
+	--dry-run --dry-run-log dryrun_log \
+	-s 148 --exit-after -a "touch dryrun_short" \
+	-l 148 -t 1000 -a "touch dryrun_long"
+add_check dryrun ne-dryrun_short ne-dryrun_long l4-dryrun_log
+
+# idle at -vvvv: scheduling is logged when it changes, not on every
+# poll the previous message woke up
+run_pattern vvvv_idle 148,1,100 148,0,1500 149,1,100 149,0,0 -- \
+	-vvvv \
+	-s 148 -a true \
+	-s 149 -a '[ "$(wc -l < vvvv_idle_log)" -lt 100 ] && touch vvvv_idle_ok' \
+	> vvvv_idle_log
+add_check vvvv_idle e-vvvv_idle_ok
+
+# key pressed at 1s, released at 2s: state must survive re-exec at 1.5s
+run_pattern upgrade 148,1,1000 148,0,0 -- \
+	-s 148 -t 3000 -a "touch upgrade_short"
+send_signal upgrade 1.5 USR2
+add_check upgrade e-upgrade_short
+
+# signals handled from poll must still be delivered after an upgrade:
+# a second upgrade happens and the recorder dumps on SIGUSR1
+run_pattern upgrade_twice 148,1,100 148,0,2000 149,1,100 149,0,0 -- \
+	-v --recorder upgrade_twice_dump \
+	-s 148 -a true \
+	-s 149 --max-runtime 5000 -a 'kill -USR1 $PPID; sleep 0.5
+		[ "$(grep -c "^restored state" upgrade_twice_log)" = 2 ] \
+		&& grep -q "key=PROG2" upgrade_twice_dump \
+		&& touch upgrade_twice_ok' > upgrade_twice_log
+send_signal upgrade_twice 1.5 USR2
+send_signal upgrade_twice 2.0 USR2
+add_check upgrade_twice e-upgrade_twice_ok
+
 check_fail sametime_short /dev/null \
 	-s 148 -t 1000 -a "echo 1" \
 	-s 148 -t 1000 -a "echo 1"
@@ -309,6 +761,33 @@ check_fail sametime_long /dev/null \
 	-s 148 -t 1000 -a "echo 1" \
 	-s 148 -t 1000 -a "echo 1"
 
+check_fail undefined_layer /dev/null \
+	-s 148 --switch-layer nope
+
+check_fail unknown_condition /dev/null \
+	-s 148 --if nope:148 -a "echo 1"
+
+check_fail abs_key_taken /dev/null \
+	--abs-threshold PROG1:ABS_Z:100:50 -s PROG1 -a "echo 1"
+
+check_fail vibrate_no_ff /dev/null \
+	-s 148 -a "echo 1" --vibrate press:148:100,50,50
+
+check_fail vibrate_pattern /dev/null \
+	-s 148 -a "echo 1" --ff /dev/null --vibrate press:148:100,150,0
+
+check_fail ff_not_input /dev/null \
+	-s 148 -a "echo 1" --ff /dev/zero --vibrate press:148:100,50,50
+
+check_fail ready_fd_closed /dev/null \
+	-s 148 -a "echo 1" --ready-fd 999
+
+check_fail abs_threshold_value /dev/null \
+	--abs-threshold stick_left:ABS_X:-20000:-1x -s stick_left -a "echo 1"
+
+check_fail log_format /dev/null \
+	--log-format xml -s 148 -a "echo 1"
+
 check_fail short_longer_long /dev/null \
 	-s 148 -t 2000 -a "echo 1" \
 	-l 148 -t 1000 -a "echo 1"
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Daemon-side deadlines (exit timeout...): timers are registered once
+ * and armed/disarmed at will, the main loop sleeps until the closest of
+ * these and the key deadlines from the library.
+ * There are only a handful of timers so a list is good enough.
+ */
+
+#include "buttond.h"
+
+void timer_register(struct state *state, struct timer *timer,
+		    void (*fire)(struct state *state, struct timer *timer)) {
+	timer->fire = fire;
+	timer->armed = false;
+	timer->next = state->timers;
+	state->timers = timer;
+}
+
+void timer_arm(struct timer *timer, const struct timespec *now, int msec) {
+	timer->deadline = *now;
+	time_add_ts(&timer->deadline, msec);
+	timer->armed = true;
+}
+
+void timer_disarm(struct timer *timer) {
+	timer->armed = false;
+}
+
+int timers_next_timeout(struct state *state, const struct timespec *now) {
+	int timeout = -1;
+
+	for (struct timer *timer = state->timers; timer; timer = timer->next) {
+		if (!timer->armed)
+			continue;
+		int64_t diff = time_diff_ts(&timer->deadline, now);
+		if (diff < 0)
+			timeout = 0;
+		else if (timeout == -1 || diff < timeout)
+			timeout = diff;
+	}
+	return timeout;
+}
+
+void timers_run(struct state *state, const struct timespec *now) {
+	for (struct timer *timer = state->timers; timer; timer = timer->next) {
+		if (!timer->armed || time_diff_ts(&timer->deadline, now) > 0)
+			continue;
+		/* fire can re-arm */
+		timer->armed = false;
+		timer->fire(state, timer);
+	}
+}
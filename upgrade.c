@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Hot upgrade: on SIGUSR2 re-exec ourselves, passing open fds and
+ * key states to the new binary so held keys and pending wakeups
+ * survive the upgrade.
+ *
+ * State is written as text lines in a memfd whose number is passed
+ * in BUTTOND_UPGRADE_FD, so the new binary does not need to share
+ * structure layouts with the old one. Lines are written in this order,
+ * those after the first only when there is something of that kind:
+ *   buttond-upgrade 1
+ *   inotify <fd>
+ *   control <fd>
+ *   exit <sec> <nsec>
+ *   idle <idx> <idle> <armed> <sec> <nsec>
+ *   process <pidfd> <pid> <layer> <code> <term sent> <armed> <sec> <nsec> <output fd>
+ *   abs <idx> (virtual key currently pressed)
+ *   vibration <idx> <effect id>
+ *   input <idx> <fd> <inotify_wd> <filename>
+ *   layer <active layer>
+ *   key <layer> <code> <state> <has_wakeup> <pressed sec> <usec> <released sec> <usec> <wakeup sec> <nsec> <stage ms>
+ * <layer> is -1 in process lines for actions not stopped on release,
+ * and the output fd is -1 if not captured. Any other version is
+ * refused and inputs are reopened.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buttond.h"
+
+#define UPGRADE_ENV "BUTTOND_UPGRADE_FD"
+#define UPGRADE_VERSION 1
+
+static volatile sig_atomic_t upgrade_requested;
+static char exe_path[PATH_MAX];
+static char **saved_argv;
+
+static void upgrade_signal(int sig) {
+	(void)sig;
+	upgrade_requested = 1;
+}
+
+void upgrade_init(char *argv[], sigset_t *blocked) {
+	ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	xassert(n > 0 && n < (ssize_t)sizeof(exe_path) - 1,
+		"Could not resolve /proc/self/exe: %m");
+	exe_path[n] = 0;
+	saved_argv = argv;
+
+	struct sigaction sa = {
+		.sa_handler = upgrade_signal,
+	};
+	sigemptyset(&sa.sa_mask);
+	xassert(sigaction(SIGUSR2, &sa, NULL) == 0,
+		"Could not setup SIGUSR2 handler: %m");
+	/* only deliver in poll, see main loop */
+	sigaddset(blocked, SIGUSR2);
+}
+
+static int set_cloexec(int fd, bool cloexec) {
+	if (fd < 0)
+		return 0;
+	int flags = fcntl(fd, F_GETFD);
+	if (flags < 0)
+		return -1;
+	if (cloexec)
+		flags |= FD_CLOEXEC;
+	else
+		flags &= ~FD_CLOEXEC;
+	return fcntl(fd, F_SETFD, flags);
+}
+
+static void set_inherit_all(struct state *state, bool inherit) {
+	for (int i = 0; i < state->input_count; i++)
+		set_cloexec(state->pollfds[i].fd, !inherit);
+	set_cloexec(pollfd_slot(state, POLLFD_INOTIFY)->fd, !inherit);
+	set_cloexec(pollfd_slot(state, POLLFD_CONTROL)->fd, !inherit);
+	for (int i = 0; i < PROCESS_MAX; i++) {
+		set_cloexec(pollfd_slot(state, POLLFD_PROCESS + i)->fd, !inherit);
+		set_cloexec(pollfd_slot(state, POLLFD_OUTPUT + i)->fd, !inherit);
+	}
+}
+
+void upgrade_check(struct state *state) {
+	if (!upgrade_requested)
+		return;
+	upgrade_requested = 0;
+
+	int fd = memfd_create("buttond-upgrade", 0);
+	if (fd < 0) {
+		fprintf(stderr, "upgrade: memfd_create failed: %m\n");
+		return;
+	}
+
+	dprintf(fd, "buttond-upgrade %d\n", UPGRADE_VERSION);
+	if (pollfd_slot(state, POLLFD_INOTIFY)->fd >= 0)
+		dprintf(fd, "inotify %d\n", pollfd_slot(state, POLLFD_INOTIFY)->fd);
+	if (pollfd_slot(state, POLLFD_CONTROL)->fd >= 0)
+		dprintf(fd, "control %d\n", pollfd_slot(state, POLLFD_CONTROL)->fd);
+	if (state->exit_timer.armed)
+		dprintf(fd, "exit %lld %ld\n",
+			(long long)state->exit_timer.deadline.tv_sec,
+			(long)state->exit_timer.deadline.tv_nsec);
+	idle_save(state, fd);
+	process_save(state, fd);
+	abs_save(state, fd);
+	ff_save(state, fd);
+	for (int i = 0; i < state->input_count; i++) {
+		dprintf(fd, "input %d %d %d %s\n", i, state->pollfds[i].fd,
+			state->input_files[i].inotify_wd,
+			state->input_files[i].filename);
+	}
+	dprintf(fd, "layer %d\n", state->ctx.layer);
+	for (int l = 0; l < state->ctx.layer_count; l++) {
+		struct buttond_layer *layer = &state->ctx.layers[l];
+		for (int i = 0; i < layer->key_count; i++) {
+			struct buttond_key *key = &layer->keys[i];
+			dprintf(fd, "key %d %d %d %d %lld %ld %lld %ld %lld %ld %d\n",
+				l, key->code, key->state, key->has_wakeup,
+				(long long)key->tv_pressed.tv_sec,
+				(long)key->tv_pressed.tv_usec,
+				(long long)key->tv_released.tv_sec,
+				(long)key->tv_released.tv_usec,
+				(long long)key->ts_wakeup.tv_sec,
+				(long)key->ts_wakeup.tv_nsec,
+				key->stage_time);
+		}
+	}
+
+	char fdstr[16];
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	if (lseek(fd, 0, SEEK_SET) != 0 || setenv(UPGRADE_ENV, fdstr, 1) != 0) {
+		fprintf(stderr, "upgrade: could not prepare state: %m\n");
+		close(fd);
+		return;
+	}
+	set_inherit_all(state, true);
+	if (state->ctx.debug)
+		log_printf("upgrading: re-executing %s\n", exe_path);
+	log_flush();
+	fflush(stderr);
+
+	execv(exe_path, saved_argv);
+
+	/* still here: keep running old binary */
+	fprintf(stderr, "upgrade: exec %s failed: %m\n", exe_path);
+	unsetenv(UPGRADE_ENV);
+	set_inherit_all(state, false);
+	close(fd);
+}
+
+static void restore_input(struct state *state, int idx, int fd, int wd,
+			  const char *filename) {
+	if (idx < 0 || idx >= state->input_count
+	    || strcmp(state->input_files[idx].filename, filename)) {
+		/* inputs changed: drop it */
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	struct pollfd *pollfd = &state->pollfds[idx];
+
+	set_cloexec(fd, true);
+	pollfd->fd = fd;
+	pollfd->events = fd >= 0 ? POLLIN : 0;
+	if (state->input_files[idx].dirent)
+		state->input_files[idx].inotify_wd = wd;
+}
+
+static struct buttond_key *find_layer_key(struct state *state, int layer,
+					  uint16_t code) {
+	if (layer < 0 || layer >= state->ctx.layer_count)
+		return NULL;
+	for (int i = 0; i < state->ctx.layers[layer].key_count; i++) {
+		if (state->ctx.layers[layer].keys[i].code == code)
+			return &state->ctx.layers[layer].keys[i];
+	}
+	return NULL;
+}
+
+static void restore_key(struct state *state, const char *line) {
+	int layer, code, key_state, has_wakeup, stage_time;
+	long long pressed_sec, released_sec, wakeup_sec;
+	long pressed_usec, released_usec, wakeup_nsec;
+
+	if (sscanf(line, "key %d %d %d %d %lld %ld %lld %ld %lld %ld %d",
+		   &layer, &code, &key_state, &has_wakeup,
+		   &pressed_sec, &pressed_usec,
+		   &released_sec, &released_usec,
+		   &wakeup_sec, &wakeup_nsec, &stage_time) != 11)
+		return;
+	struct buttond_key *key = find_layer_key(state, layer, code);
+	if (!key || key_state < BUTTOND_KEY_RELEASED || key_state > BUTTOND_KEY_HANDLED)
+		return;
+	key->state = key_state;
+	key->has_wakeup = has_wakeup;
+	key->tv_pressed.tv_sec = pressed_sec;
+	key->tv_pressed.tv_usec = pressed_usec;
+	key->tv_released.tv_sec = released_sec;
+	key->tv_released.tv_usec = released_usec;
+	key->ts_wakeup.tv_sec = wakeup_sec;
+	key->ts_wakeup.tv_nsec = wakeup_nsec;
+	key->stage_time = stage_time;
+}
+
+/* we are an upgraded buttond, until upgrade_restore */
+bool upgrade_pending(void) {
+	return getenv(UPGRADE_ENV) != NULL;
+}
+
+/* returns true if state was restored from previous binary.
+ * Inputs that were not passed are marked with fd -1 */
+bool upgrade_restore(struct state *state) {
+	const char *env = getenv(UPGRADE_ENV);
+	if (!env)
+		return false;
+	int fd = strtoint(env);
+	unsetenv(UPGRADE_ENV);
+	xassert(errno == 0, "Invalid %s: %s", UPGRADE_ENV, env);
+
+	FILE *f = fdopen(fd, "r");
+	xassert(f, "Could not open upgrade state: %m");
+
+	char *line = NULL;
+	size_t len = 0;
+	int version = 0;
+	if (getline(&line, &len, f) <= 0
+	    || sscanf(line, "buttond-upgrade %d", &version) != 1
+	    || version != UPGRADE_VERSION) {
+		fprintf(stderr, "Unsupported upgrade state version %d, reopening inputs\n",
+			version);
+		free(line);
+		fclose(f);
+		return false;
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "inotify ", 8) == 0) {
+			int inotify_fd = strtoint(line + 8);
+			if (errno || !state->inotify_enabled) {
+				close(inotify_fd);
+				continue;
+			}
+			set_cloexec(inotify_fd, true);
+			pollfd_slot(state, POLLFD_INOTIFY)->fd = inotify_fd;
+			pollfd_slot(state, POLLFD_INOTIFY)->events = POLLIN;
+		} else if (strncmp(line, "control ", 8) == 0) {
+			int control_fd = strtoint(line + 8);
+			if (errno)
+				continue;
+			/* control_open closes it if no longer wanted */
+			set_cloexec(control_fd, true);
+			pollfd_slot(state, POLLFD_CONTROL)->fd = control_fd;
+			pollfd_slot(state, POLLFD_CONTROL)->events = POLLIN;
+		} else if (strncmp(line, "exit ", 5) == 0) {
+			long long sec;
+			long nsec;
+			if (!state->exit_timer.fire
+			    || sscanf(line, "exit %lld %ld", &sec, &nsec) != 2)
+				continue;
+			state->exit_timer.deadline.tv_sec = sec;
+			state->exit_timer.deadline.tv_nsec = nsec;
+			state->exit_timer.armed = true;
+		} else if (strncmp(line, "idle ", 5) == 0) {
+			idle_restore(state, line);
+		} else if (strncmp(line, "process ", 8) == 0) {
+			process_restore(state, line);
+		} else if (strncmp(line, "abs ", 4) == 0) {
+			abs_restore(state, line);
+		} else if (strncmp(line, "vibration ", 10) == 0) {
+			ff_restore(state, line);
+		} else if (strncmp(line, "layer ", 6) == 0) {
+			int layer = strtoint(line + 6);
+			if (errno == 0)
+				buttond_set_layer(&state->ctx, layer);
+		} else if (strncmp(line, "input ", 6) == 0) {
+			int idx, input_fd, wd, pos;
+			if (sscanf(line, "input %d %d %d %n",
+				   &idx, &input_fd, &wd, &pos) != 3)
+				continue;
+			restore_input(state, idx, input_fd, wd, line + pos);
+		} else if (strncmp(line, "key ", 4) == 0) {
+			restore_key(state, line);
+		}
+	}
+	free(line);
+	fclose(f);
+
+	if (state->ctx.debug)
+		log_printf("restored state from previous buttond\n");
+	return true;
+}
@@ -8,6 +8,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define xassert(cond, fmt, args...) \
@@ -28,6 +29,12 @@ static inline void *xreallocarray(void *ptr, size_t nmemb, size_t size) {
 	return ptr;
 }
 
+static inline char *xstrdup(const char *str) {
+	char *dup = strdup(str);
+	xassert(dup, "Allocation failure");
+	return dup;
+}
+
 static inline ssize_t read_safe(int fd, void *buf, ssize_t count) {
 	ssize_t total = 0;
 
@@ -80,4 +87,22 @@ static inline uint32_t strtoint(const char *str) {
 	return val;
 }
 
+/* signed, e.g. for absolute axis values */
+static inline int32_t strtos32(const char *str) {
+	char *endptr;
+	long long val;
+
+	val = strtoll(str, &endptr, 0);
+	if (endptr == str || *endptr != 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (val < INT32_MIN || val > INT32_MAX) {
+		errno = ERANGE;
+		return 0;
+	}
+	errno = 0;
+	return val;
+}
+
 #endif